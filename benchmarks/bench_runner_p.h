@@ -0,0 +1,75 @@
+#pragma once
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#define PROFILE_CONCAT_INTERNAL(X, Y) X##Y
+#define PROFILE_CONCAT(X, Y) PROFILE_CONCAT_INTERNAL(X, Y)
+#define UNIQUE_VAR_NAME_PROFILE PROFILE_CONCAT(profileGuard, __LINE__)
+#define LOG_DURATION(x) LogDuration UNIQUE_VAR_NAME_PROFILE(x)
+
+class LogDuration
+{
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit LogDuration(std::string_view id, std::ostream &out = std::cerr) : id_(id), out_(out)
+    {
+    }
+
+    ~LogDuration()
+    {
+        using namespace std::chrono;
+        const auto dur = Clock::now() - start_time_;
+        out_ << "    " << id_ << ": " << duration_cast<microseconds>(dur).count() / 1000.0 << " ms" << std::endl;
+    }
+
+  private:
+    const std::string id_;
+    const Clock::time_point start_time_ = Clock::now();
+    std::ostream &out_;
+};
+
+// Keeps the compiler from throwing away results of benchmarked code
+template <typename T> void DoNotOptimize(const T &value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+class BenchmarkRunner
+{
+  public:
+    // Benchmarks can be filtered by passing substrings of their names
+    // as command line arguments
+    BenchmarkRunner(int argc, char *argv[]) : filters_(argv + 1, argv + argc)
+    {
+    }
+
+    template <class BenchFunc> void RunBenchmark(BenchFunc func, const std::string &bench_name)
+    {
+        if (!Selected(bench_name))
+            return;
+        std::cerr << bench_name << ":" << std::endl;
+        func();
+    }
+
+  private:
+    std::vector<std::string> filters_;
+
+    bool Selected(const std::string &bench_name) const
+    {
+        if (filters_.empty())
+            return true;
+        for (const auto &filter : filters_)
+        {
+            if (bench_name.find(filter) != std::string::npos)
+                return true;
+        }
+        return false;
+    }
+};
+
+#define RUN_BENCHMARK(br, func) br.RunBenchmark(func, #func)
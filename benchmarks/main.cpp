@@ -0,0 +1,1278 @@
+#include "../src/cell.h"
+#include "../src/common.h"
+#include "../src/FormulaAST.h"
+#include "../src/flat_position_map.h"
+#include "../src/sheet.h"
+#include "../src/tiled_table.h"
+#include "bench_runner_p.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <malloc.h>
+#include <new>
+#include <random>
+#include <streambuf>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+
+// Every allocation of the benchmark binary is counted, see AllocationCounter
+namespace
+{
+size_t allocations_count = 0;
+size_t allocated_bytes = 0; // currently allocated through operator new
+} // namespace
+
+void *operator new(size_t size)
+{
+    ++allocations_count;
+    if (void *result = std::malloc(size ? size : 1))
+    {
+        allocated_bytes += malloc_usable_size(result);
+        return result;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept
+{
+    allocated_bytes -= malloc_usable_size(ptr);
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    allocated_bytes -= malloc_usable_size(ptr);
+    std::free(ptr);
+}
+
+namespace
+{
+// Resident set size of the process, 0 where /proc is not available
+size_t ResidentBytes()
+{
+    std::ifstream statm("/proc/self/statm");
+    size_t total_pages{0}, resident_pages{0};
+    statm >> total_pages >> resident_pages;
+    return resident_pages * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+using HashTable = std::unordered_map<Position, Cell, Position::Hasher>;
+
+std::vector<Position> DenseFill()
+{
+    std::vector<Position> result;
+    for (int row = 0; row < 2000; ++row)
+    {
+        for (int col = 0; col < 100; ++col)
+        {
+            result.push_back({row, col});
+        }
+    }
+    return result;
+}
+
+std::vector<Position> SparseFill()
+{
+    std::mt19937 generator(42);
+    std::uniform_int_distribution<int> coord(0, 1023);
+    std::vector<Position> result;
+    for (int i = 0; i < 20000; ++i)
+    {
+        result.push_back({coord(generator), coord(generator)});
+    }
+    return result;
+}
+
+std::vector<Position> DiagonalFill()
+{
+    std::vector<Position> result;
+    for (int i = 0; i < Position::MAX_ROWS; ++i)
+    {
+        result.push_back({i, i});
+    }
+    return result;
+}
+
+Size BoundingSize(const std::vector<Position> &positions)
+{
+    Size size;
+    for (auto pos : positions)
+    {
+        size.rows = std::max(size.rows, pos.row + 1);
+        size.cols = std::max(size.cols, pos.col + 1);
+    }
+    return size;
+}
+
+void RunStoragePattern(const std::string &name, const std::vector<Position> &positions)
+{
+    const Size size = BoundingSize(positions);
+    // the printable area of the diagonal pattern is the whole sheet, scan only its corner
+    const Size scan{std::min(size.rows, 4096), std::min(size.cols, 4096)};
+    std::cerr << "  " << name << " (" << positions.size() << " writes, " << scan.rows << "x" << scan.cols
+              << " scan):" << std::endl;
+
+    HashTable hash_table;
+    {
+        LOG_DURATION("unordered_map insert");
+        for (auto pos : positions)
+            hash_table[pos].Set("1");
+    }
+    {
+        LOG_DURATION("unordered_map row-major scan");
+        size_t found{0};
+        for (int row = 0; row < scan.rows; ++row)
+            for (int col = 0; col < scan.cols; ++col)
+                found += hash_table.count({row, col});
+        DoNotOptimize(found);
+    }
+
+    TiledTable<Cell> tiled_table;
+    {
+        LOG_DURATION("TiledTable insert");
+        for (auto pos : positions)
+            tiled_table.Emplace(pos).Set("1");
+    }
+    {
+        LOG_DURATION("TiledTable row-major scan");
+        size_t found{0};
+        for (int row = 0; row < scan.rows; ++row)
+            for (int col = 0; col < scan.cols; ++col)
+                found += tiled_table.Contains({row, col});
+        DoNotOptimize(found);
+    }
+    {
+        LOG_DURATION("TiledTable ForEach");
+        size_t found{0};
+        tiled_table.ForEach([&found](Position, const Cell &) { ++found; });
+        DoNotOptimize(found);
+    }
+    std::cerr << "    TiledTable: " << tiled_table.TileCount() << " tiles, "
+              << tiled_table.AllocatedBytes() / 1024 << " KiB" << std::endl;
+}
+
+void BenchmarkCellStorage()
+{
+    RunStoragePattern("dense", DenseFill());
+    RunStoragePattern("sparse", SparseFill());
+    RunStoragePattern("diagonal", DiagonalFill());
+}
+
+// Hasher used by the sheet before keys were packed and mixed
+struct LegacyHasher
+{
+    size_t operator()(const Position &pos) const
+    {
+        return pos.row + 37 * pos.col;
+    }
+};
+
+std::ostream &operator<<(std::ostream &out, const FlatMapStats &stats)
+{
+    return out << stats.size << " keys, load " << stats.LoadFactor() << ", displaced " << stats.displaced
+               << ", mean probe " << stats.MeanProbeLength() << ", max probe " << stats.max_probe_length;
+}
+
+template <typename Hasher> void RunHashPattern(const std::vector<Position> &positions)
+{
+    std::unordered_map<Position, int, Hasher> map;
+    for (auto pos : positions)
+        map[pos] = 0;
+    size_t colliding{0}, max_bucket{0};
+    for (size_t bucket = 0; bucket < map.bucket_count(); ++bucket)
+    {
+        colliding += map.bucket_size(bucket) > 1 ? map.bucket_size(bucket) - 1 : 0;
+        max_bucket = std::max(max_bucket, map.bucket_size(bucket));
+    }
+    std::cerr << "    unordered_map: " << colliding << " keys share a bucket, max bucket " << max_bucket << std::endl;
+    {
+        LOG_DURATION("unordered_map lookups");
+        size_t found{0};
+        for (int repeat = 0; repeat < 10; ++repeat)
+            for (auto pos : positions)
+                found += map.count(pos);
+        DoNotOptimize(found);
+    }
+}
+
+void RunFlatMapPattern(const std::string &name, const std::vector<Position> &positions)
+{
+    std::cerr << "  " << name << ":" << std::endl;
+    std::cerr << "    row + 37 * col hasher" << std::endl;
+    RunHashPattern<LegacyHasher>(positions);
+    std::cerr << "    mixed packed key hasher" << std::endl;
+    RunHashPattern<Position::Hasher>(positions);
+
+    FlatPositionMap<int> map;
+    for (auto pos : positions)
+        map.Emplace(pos) = 0;
+    std::cerr << "    FlatPositionMap: " << map.GetStats() << std::endl;
+    {
+        LOG_DURATION("FlatPositionMap lookups");
+        size_t found{0};
+        for (int repeat = 0; repeat < 10; ++repeat)
+            for (auto pos : positions)
+                found += map.Contains(pos);
+        DoNotOptimize(found);
+    }
+}
+
+std::vector<Position> DiagonalBandFill()
+{
+    std::vector<Position> result;
+    for (int row = 0; row < 5000; ++row)
+    {
+        for (int col = std::max(0, row - 10); col <= row + 10; ++col)
+        {
+            result.push_back({row, col});
+        }
+    }
+    return result;
+}
+
+void BenchmarkFlatPositionMap()
+{
+    RunFlatMapPattern("dense", DenseFill());
+    RunFlatMapPattern("sparse", SparseFill());
+    RunFlatMapPattern("diagonal band", DiagonalBandFill());
+
+    // workbook-like sheet: a column of inputs and two columns of formulas over it
+    Sheet sheet;
+    for (int row = 0; row < 10000; ++row)
+    {
+        const std::string row_name = std::to_string(row + 1);
+        sheet.SetCell({row, 0}, row_name);
+        sheet.SetCell({row, 1}, "=A" + row_name + "*2");
+        sheet.SetCell({row, 2}, "=A" + row_name + "+B" + row_name);
+    }
+    std::cerr << "  workbook:" << std::endl;
+    std::cerr << "    sparse cell tiles: " << sheet.GetCellStorageStats() << std::endl;
+    std::cerr << "    dependency graph: " << sheet.GetGraphStats() << std::endl;
+}
+
+void BenchmarkBulkClear()
+{
+    constexpr int rows = 1000, cols = 500;
+    Sheet sheet;
+    {
+        LOG_DURATION("fill " + std::to_string(rows) + "x" + std::to_string(cols) + " text cells");
+        for (int row = 0; row < rows; ++row)
+            for (int col = 0; col < cols; ++col)
+                sheet.SetCell({row, col}, "text");
+    }
+    {
+        LOG_DURATION("clear last column");
+        for (int row = 0; row < rows; ++row)
+            sheet.ClearCell({row, cols - 1});
+    }
+    {
+        LOG_DURATION("clear bottom half of rows");
+        for (int row = rows / 2; row < rows; ++row)
+            for (int col = 0; col < cols; ++col)
+                sheet.ClearCell({row, col});
+    }
+    {
+        LOG_DURATION("clear the rest from the top-left corner");
+        for (int row = 0; row < rows / 2; ++row)
+            for (int col = 0; col < cols - 1; ++col)
+                sheet.ClearCell({row, col});
+    }
+    const Size size = sheet.GetPrintableSize();
+    std::cerr << "    printable size after clearing: " << size.rows << "x" << size.cols << std::endl;
+}
+
+void RunEvaluationComparison(const std::string &name, const SheetInterface &sheet, const std::string &expression,
+                             int repeats)
+{
+    auto ast = ParseFormulaAST(expression);
+    std::cerr << "  " << name << " (" << repeats << " evaluations):" << std::endl;
+    {
+        LOG_DURATION("tree walker");
+        double sum{0};
+        for (int i = 0; i < repeats; ++i)
+            sum += std::get<double>(ast.ExecuteTree(sheet));
+        DoNotOptimize(sum);
+    }
+    {
+        LOG_DURATION("bytecode VM");
+        double sum{0};
+        for (int i = 0; i < repeats; ++i)
+            sum += std::get<double>(ast.Execute(sheet));
+        DoNotOptimize(sum);
+    }
+}
+
+void BenchmarkFormulaEvaluation()
+{
+    Sheet sheet;
+    for (int row = 0; row < 100; ++row)
+    {
+        sheet.SetCell({row, 0}, std::to_string(row % 7 + 1));
+        sheet.SetCell({row, 1}, std::to_string(row % 5 + 2));
+    }
+
+    std::string constants = "1";
+    for (int i = 0; i < 200; ++i)
+        constants = "(" + constants + "+" + std::to_string(i % 9 + 1) + ")*0.5";
+    RunEvaluationComparison("deep constants", sheet, constants, 100000);
+
+    std::string deep = "A1";
+    for (int i = 1; i < 200; ++i)
+        deep = "A" + std::to_string(i + 1) + "-(" + deep + ")";
+    RunEvaluationComparison("deep references", sheet, deep, 20000);
+
+    std::string wide = "A1*B1";
+    for (int i = 2; i <= 100; ++i)
+        wide += "+A" + std::to_string(i) + "*B" + std::to_string(i);
+    RunEvaluationComparison("wide references", sheet, wide, 20000);
+}
+
+void BenchmarkFormulaParsing()
+{
+    constexpr int formulas_count = 100000;
+    std::vector<std::string> formulas;
+    formulas.reserve(formulas_count);
+    for (int i = 0; i < formulas_count; ++i)
+    {
+        const std::string row = std::to_string(i % Position::MAX_ROWS + 1);
+        formulas.push_back("(A" + row + " + B" + row + ") * 1.5 - C" + row + " / (D" + row + " - 2e3)");
+    }
+
+    for (auto [name, mode] : {std::pair{"hand-written parser", FormulaParserMode::HandWritten},
+                              std::pair{"ANTLR parser", FormulaParserMode::Antlr}})
+    {
+        LOG_DURATION(name + std::string(", ") + std::to_string(formulas_count) + " formulas");
+        size_t nodes{0};
+        for (const auto &formula : formulas)
+            nodes += ParseFormulaAST(formula, mode).GetReferencedCells().size();
+        DoNotOptimize(nodes);
+    }
+}
+
+void BenchmarkRecalculation()
+{
+    // layered sheet: a row of inputs and every next row sums two neighbours of the row above
+    constexpr int layers = 200, width = 200;
+    Sheet sheet;
+    for (int col = 0; col < width; ++col)
+        sheet.SetCell({0, col}, std::to_string(col % 10));
+    for (int row = 1; row < layers; ++row)
+    {
+        for (int col = 0; col < width; ++col)
+        {
+            const Position left{row - 1, col}, right{row - 1, (col + 1) % width};
+            sheet.SetCell({row, col}, "=" + left.ToString() + "+" + right.ToString() + "*0.5");
+        }
+    }
+    std::cerr << "  " << layers << " layers of " << width << " formulas:" << std::endl;
+    {
+        const RecalculationStats stats = sheet.Recalculate();
+        std::cerr << "    initial Recalculate(): " << stats.recomputed_cells << " cells in "
+                  << std::chrono::duration_cast<std::chrono::milliseconds>(stats.duration).count() << " ms"
+                  << std::endl;
+    }
+    {
+        size_t recomputed{0};
+        auto total = std::chrono::nanoseconds::zero();
+        for (int i = 0; i < 20; ++i)
+        {
+            sheet.SetCell({0, i * 7 % width}, std::to_string(i));
+            const RecalculationStats stats = sheet.Recalculate();
+            recomputed += stats.recomputed_cells;
+            total += stats.duration;
+        }
+        std::cerr << "    20 input edits + Recalculate(): " << recomputed << " cells in "
+                  << std::chrono::duration_cast<std::chrono::milliseconds>(total).count() << " ms" << std::endl;
+    }
+    {
+        LOG_DURATION("20 input edits + lazy read of the last layer");
+        double sum{0};
+        for (int i = 0; i < 20; ++i)
+        {
+            sheet.SetCell({0, i * 7 % width}, std::to_string(i + 1));
+            for (int col = 0; col < width; ++col)
+                sum += std::get<double>(sheet.GetCell({layers - 1, col})->GetValue());
+        }
+        DoNotOptimize(sum);
+    }
+}
+
+void BenchmarkCycleDetection()
+{
+    constexpr int chain_length = 10000, edits = 10000;
+    {
+        Sheet sheet;
+        LOG_DURATION("chain of " + std::to_string(chain_length) + " built top-down");
+        sheet.SetCell({0, 0}, "1");
+        for (int row = 1; row < chain_length; ++row)
+            sheet.SetCell({row, 0}, "=" + Position{row - 1, 0}.ToString() + "+1");
+    }
+    Sheet sheet;
+    {
+        LOG_DURATION("chain of " + std::to_string(chain_length) + " built bottom-up");
+        for (int row = 0; row < chain_length - 1; ++row)
+            sheet.SetCell({row, 0}, "=" + Position{row + 1, 0}.ToString() + "+1");
+        sheet.SetCell({chain_length - 1, 0}, "1");
+    }
+    {
+        // each edit used to walk the whole chain below the edited cell
+        LOG_DURATION(std::to_string(edits) + " edits of the chain head");
+        for (int i = 0; i < edits; ++i)
+            sheet.SetCell({0, 1}, "=A1+" + std::to_string(i));
+    }
+    {
+        LOG_DURATION(std::to_string(edits / 10) + " rejected cycles through the chain");
+        size_t rejected{0};
+        for (int i = 0; i < edits / 10; ++i)
+        {
+            try
+            {
+                sheet.SetCell({chain_length - 1, 0}, "=B1+" + std::to_string(i));
+            }
+            catch (const CircularDependencyException &)
+            {
+                ++rejected;
+            }
+        }
+        DoNotOptimize(rejected);
+    }
+
+    // every edit sets a formula over 200 chain cells
+    std::vector<std::string> fan_in_formulas;
+    for (int i = 0; i < 10; ++i)
+    {
+        std::string formula = "=0";
+        for (int k = 0; k < 200; ++k)
+            formula += "+A" + std::to_string((k * 37 + i) % chain_length + 1);
+        fan_in_formulas.push_back(std::move(formula));
+    }
+    {
+        LOG_DURATION(std::to_string(edits / 10) + " high fan-in edits");
+        for (int i = 0; i < edits / 10; ++i)
+            sheet.SetCell({i % 100, 2}, fan_in_formulas[i % fan_in_formulas.size()]);
+    }
+}
+
+void BenchmarkDeepChainEvaluation()
+{
+    Sheet sheet;
+    {
+        LOG_DURATION("fill a column with a chain of " + std::to_string(Position::MAX_ROWS) + " formulas");
+        sheet.SetCell({0, 0}, "1");
+        for (int row = 1; row < Position::MAX_ROWS; ++row)
+            sheet.SetCell({row, 0}, "=" + Position{row - 1, 0}.ToString() + "+1");
+    }
+    {
+        LOG_DURATION("first evaluation of the last cell");
+        DoNotOptimize(sheet.GetCell({Position::MAX_ROWS - 1, 0})->GetValue());
+    }
+    sheet.SetCell({0, 0}, "2");
+    {
+        LOG_DURATION("evaluation after the head of the chain changed");
+        DoNotOptimize(sheet.GetCell({Position::MAX_ROWS - 1, 0})->GetValue());
+    }
+}
+
+void BenchmarkRangeSum()
+{
+    constexpr int cols = 64;
+    Sheet sheet;
+    {
+        LOG_DURATION("fill " + std::to_string(Position::MAX_ROWS) + "x" + std::to_string(cols) + " numbers");
+        for (int row = 0; row < Position::MAX_ROWS; ++row)
+            for (int col = 0; col < cols; ++col)
+                sheet.SetCell({row, col}, std::to_string((row + col) % 100));
+    }
+
+    // ranges of 1k, 100k and 1M cells, all of them start at A1
+    for (auto [rows, range_cols] : {std::pair{1000, 1}, std::pair{1563, cols}, std::pair{Position::MAX_ROWS, cols}})
+    {
+        const Range range{{0, 0}, {rows - 1, range_cols - 1}};
+        std::cerr << "  SUM over " << range.CellCount() << " cells:" << std::endl;
+        const Position formula{0, cols + 1};
+        {
+            LOG_DURATION("set formula");
+            sheet.SetCell(formula, "=SUM(" + range.ToString() + ")");
+        }
+        {
+            LOG_DURATION("first evaluation");
+            DoNotOptimize(sheet.GetCell(formula)->GetValue());
+        }
+        {
+            LOG_DURATION("10 evaluations after a change inside the range");
+            for (int i = 0; i < 10; ++i)
+            {
+                sheet.SetCell({i, 0}, std::to_string(range.CellCount() + i));
+                DoNotOptimize(sheet.GetCell(formula)->GetValue());
+            }
+        }
+    }
+
+    // the same 1k cells summed with a chain of additions
+    std::string chain = "A1";
+    for (int row = 2; row <= 1000; ++row)
+        chain += "+A" + std::to_string(row);
+    std::cerr << "  '+' chain over 1000 cells:" << std::endl;
+    const Position formula{1, cols + 1};
+    {
+        LOG_DURATION("set formula");
+        sheet.SetCell(formula, "=" + chain);
+    }
+    {
+        LOG_DURATION("first evaluation");
+        DoNotOptimize(sheet.GetCell(formula)->GetValue());
+    }
+}
+
+void BenchmarkErrorPropagation()
+{
+    // one error cell feeding 50k formulas directly and through chains
+    constexpr int rows = 12500, cols = 4;
+    Sheet sheet;
+    sheet.SetCell({0, cols}, "=1/0");
+    for (int row = 0; row < rows; ++row)
+    {
+        const std::string row_name = std::to_string(row + 1);
+        sheet.SetCell({row, 0}, "=E1*2+" + row_name);
+        sheet.SetCell({row, 1}, "=A" + row_name + "-E1");
+        sheet.SetCell({row, 2}, row == 0 ? "=E1" : "=C" + std::to_string(row) + "+1");
+        sheet.SetCell({row, 3}, "=(B" + row_name + "+C" + row_name + ")/2");
+    }
+    std::cerr << "  " << rows * cols << " formulas depending on an error:" << std::endl;
+    for (const char *source : {"=1/0", "text", "=1/0", "text"})
+    {
+        sheet.SetCell({0, cols}, source);
+        const RecalculationStats stats = sheet.Recalculate();
+        std::cerr << "    source " << source << ": " << stats.recomputed_cells << " cells recalculated in "
+                  << std::chrono::duration_cast<std::chrono::microseconds>(stats.duration).count() / 1000.0 << " ms"
+                  << std::endl;
+    }
+}
+// Reports the number of allocations made during its lifetime
+class AllocationCounter
+{
+  public:
+    explicit AllocationCounter(std::string id) : id_(std::move(id)), start_(allocations_count)
+    {
+    }
+
+    ~AllocationCounter()
+    {
+        std::cerr << "    " << id_ << ": " << allocations_count - start_ << " allocations" << std::endl;
+    }
+
+  private:
+    const std::string id_;
+    const size_t start_;
+};
+
+// Stream buffer which drops everything, so that printing itself does not allocate
+class NullBuffer : public std::streambuf
+{
+  protected:
+    int overflow(int ch) override
+    {
+        return ch;
+    }
+
+    std::streamsize xsputn(const char *, std::streamsize count) override
+    {
+        return count;
+    }
+};
+
+void BenchmarkPrintValues()
+{
+    constexpr int rows = 2000, cols = 50;
+    Sheet sheet;
+    for (int row = 0; row < rows; ++row)
+    {
+        for (int col = 0; col < cols; ++col)
+        {
+            const std::string text = "text value of row " + std::to_string(row) + " column " + std::to_string(col);
+            sheet.SetCell({row, col}, col % 10 == 0 ? "'" + text : text);
+        }
+    }
+
+    NullBuffer buffer;
+    std::ostream output(&buffer);
+    std::cerr << "  " << rows * cols << " text cells:" << std::endl;
+    {
+        LOG_DURATION("GetValue of every cell");
+        AllocationCounter counter("GetValue of every cell");
+        for (int row = 0; row < rows; ++row)
+        {
+            for (int col = 0; col < cols; ++col)
+                output << sheet.GetCell({row, col})->GetValue() << '\t';
+            output << '\n';
+        }
+    }
+    {
+        LOG_DURATION("PrintValues");
+        AllocationCounter counter("PrintValues");
+        sheet.PrintValues(output);
+    }
+}
+
+void BenchmarkPrintTexts()
+{
+    constexpr int rows = 2000, cols = 50;
+    Sheet sheet;
+    std::vector<std::string> texts;
+    for (int row = 0; row < rows; ++row)
+    {
+        for (int col = 0; col < cols; ++col)
+        {
+            // references point outside of the formula block, so there are no cycles
+            const Position ref{rows + row / 2, (col + 1) % cols};
+            texts.push_back("=(" + ref.ToString() + "+" + std::to_string(col) + ")*SUM(BA1:BB" +
+                            std::to_string(row + 1) + ")/2-" + ref.ToString());
+            sheet.SetCell({row, col}, texts.back());
+        }
+    }
+
+    NullBuffer buffer;
+    std::ostream output(&buffer);
+    std::cerr << "  " << rows * cols << " formula cells:" << std::endl;
+    {
+        LOG_DURATION("PrintTexts");
+        AllocationCounter counter("PrintTexts");
+        sheet.PrintTexts(output);
+    }
+    {
+        LOG_DURATION("SetCell with unchanged texts");
+        for (int row = 0; row < rows; ++row)
+            for (int col = 0; col < cols; ++col)
+                sheet.SetCell({row, col}, texts[row * cols + col]);
+    }
+}
+
+void BenchmarkReferencedCells()
+{
+    constexpr int rows = 8000, cols = 10, reads = 100;
+    Sheet sheet;
+    {
+        LOG_DURATION("set " + std::to_string(rows * cols) + " formulas with 8 references");
+        for (int row = 0; row < rows; ++row)
+        {
+            const std::string next = std::to_string(rows + row + 1);
+            for (int col = 0; col < cols; ++col)
+            {
+                const std::string left = Position{0, col}.ToString(), right = Position{0, col + 1}.ToString();
+                const std::string a = left.substr(0, left.size() - 1) + next;
+                const std::string b = right.substr(0, right.size() - 1) + next;
+                sheet.SetCell({row, col}, "=" + a + "+" + b + "*2-(" + a + "+" + b + ")/3+" + b + "-" + a + "*" + b +
+                                              "+" + a);
+            }
+        }
+    }
+    {
+        LOG_DURATION(std::to_string(reads) + " reads of referenced cells of every formula");
+        size_t count{0};
+        for (int i = 0; i < reads; ++i)
+            for (int row = 0; row < rows; ++row)
+                for (int col = 0; col < cols; ++col)
+                    count += sheet.GetCell({row, col})->GetReferencedCells().size();
+        DoNotOptimize(count);
+    }
+}
+
+void BenchmarkFilledColumns()
+{
+    // one formula per column filled down, as in =B2*C2, =B3*C3, ...
+    constexpr int rows = 16000, inputs = 4;
+    const std::vector<std::string> shapes{"A{}*B{}", "(A{}+B{})/2-C{}", "D{}*1.5+A{}*B{}-C{}/(D{}+1)", "SUM(A{}:D{})",
+                                          "E{}+F{}*G{}"};
+    const size_t count = rows * shapes.size();
+    std::vector<std::pair<Position, std::string>> formulas;
+    for (int row = 0; row < rows; ++row)
+    {
+        const std::string name = std::to_string(row + 1);
+        for (size_t shape = 0; shape < shapes.size(); ++shape)
+        {
+            std::string text;
+            for (char ch : shapes[shape])
+            {
+                if (ch == '{')
+                    text += name;
+                else if (ch != '}')
+                    text += ch;
+            }
+            formulas.emplace_back(Position{row, inputs + static_cast<int>(shape)}, std::move(text));
+        }
+    }
+
+    std::cerr << "  " << count << " formula objects:" << std::endl;
+    auto parse_all = [&formulas, count](const std::string &name, auto parse) {
+        std::vector<std::unique_ptr<FormulaInterface>> result;
+        result.reserve(count);
+        const size_t bytes_before = allocated_bytes;
+        {
+            LOG_DURATION(name);
+            for (const auto &[pos, text] : formulas)
+                result.push_back(parse(pos, text));
+        }
+        std::cerr << "    " << (allocated_bytes - bytes_before) / count << " heap bytes per formula" << std::endl;
+    };
+    parse_all("ParseFormula", [](Position, const std::string &text) { return ParseFormula(text); });
+    FormulaCache cache;
+    parse_all("FormulaCache",
+              [&cache](Position pos, const std::string &text) { return cache.ParseFormula(text, pos); });
+
+    std::cerr << "  " << count << " formulas in a sheet:" << std::endl;
+    Sheet sheet;
+    for (int row = 0; row < rows; ++row)
+        for (int col = 0; col < inputs; ++col)
+            sheet.SetCell({row, col}, std::to_string(row + col));
+    const size_t bytes_before = allocated_bytes;
+    {
+        LOG_DURATION("fill " + std::to_string(shapes.size()) + " columns of " + std::to_string(rows) + " rows");
+        for (const auto &[pos, text] : formulas)
+            sheet.SetCell(pos, "=" + text);
+    }
+    std::cerr << "    " << (allocated_bytes - bytes_before) / count << " heap bytes per formula with cells and graph, "
+              << sheet.GetSharedFormulaCount() << " compiled formulas" << std::endl;
+    {
+        LOG_DURATION("evaluate all formulas");
+        DoNotOptimize(sheet.Recalculate().recomputed_cells);
+    }
+}
+void BenchmarkBulkImport()
+{
+    // a column of inputs, every other cell adds the cell to the left and the cell above
+    constexpr int rows = 5000, cols = 20;
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < rows; ++row)
+    {
+        cells.emplace_back(Position{row, 0}, std::to_string(row % 100));
+        for (int col = 1; col < cols; ++col)
+        {
+            const Position left{row, col - 1}, above{std::max(row - 1, 0), col};
+            cells.emplace_back(Position{row, col}, "=" + left.ToString() + "+" + above.ToString() + "/2");
+        }
+    }
+    // the cell above of the first row is the cell itself
+    for (int col = 1; col < cols; ++col)
+        cells[col].second = "=" + Position{0, col - 1}.ToString() + "*2";
+    auto shuffled = cells;
+    std::shuffle(shuffled.begin(), shuffled.end(), std::mt19937(42));
+
+    auto import = [](const std::string &name, const std::vector<std::pair<Position, std::string>> &cells,
+                     RecalculationMode mode, bool batch) {
+        Sheet sheet;
+        sheet.SetRecalculationMode(mode);
+        {
+            LOG_DURATION(name + (batch ? ", SetCells" : ", SetCell"));
+            if (batch)
+            {
+                sheet.SetCells(cells);
+            }
+            else
+            {
+                for (const auto &[pos, text] : cells)
+                    sheet.SetCell(pos, text);
+            }
+        }
+        DoNotOptimize(sheet.GetCell({rows - 1, cols - 1})->GetValue());
+    };
+    std::cerr << "  " << cells.size() << " cells:" << std::endl;
+    for (bool batch : {false, true})
+    {
+        import("row by row", cells, RecalculationMode::Lazy, batch);
+        import("shuffled", shuffled, RecalculationMode::Lazy, batch);
+        import("row by row, automatic recalculation", cells, RecalculationMode::Automatic, batch);
+    }
+
+    // pasting over inputs with evaluated dependants
+    Sheet sheet;
+    sheet.SetCells(cells);
+    for (bool batch : {false, true})
+    {
+        sheet.Recalculate();
+        std::vector<std::pair<Position, std::string>> inputs;
+        for (int row = 0; row < rows; ++row)
+            inputs.emplace_back(Position{row, 0}, std::to_string(row % 100 + (batch ? 2 : 1)));
+        LOG_DURATION("paste " + std::to_string(rows) + " inputs and recalculate" +
+                     (batch ? ", SetCells" : ", SetCell"));
+        if (batch)
+        {
+            sheet.SetCells(inputs);
+        }
+        else
+        {
+            for (const auto &[pos, text] : inputs)
+                sheet.SetCell(pos, text);
+        }
+        DoNotOptimize(sheet.Recalculate().recomputed_cells);
+    }
+}
+
+void BenchmarkParallelImport()
+{
+    // every formula of the first workbook has its own shape, the second one is filled down
+    constexpr int rows = 10000, cols = 10;
+    std::vector<std::pair<Position, std::string>> unique, filled;
+    for (int row = 0; row < rows; ++row)
+    {
+        const std::string name = std::to_string(row + 1);
+        unique.emplace_back(Position{row, 0}, std::to_string(row));
+        filled.emplace_back(Position{row, 0}, std::to_string(row));
+        for (int col = 1; col < cols; ++col)
+        {
+            const std::string left = "=(" + Position{row, col - 1}.ToString() + "+";
+            const std::string right = ")*MAX(A" + name + ",2)/7";
+            unique.emplace_back(Position{row, col}, left + std::to_string(row * cols + col) + right);
+            filled.emplace_back(Position{row, col}, left + std::to_string(col) + right);
+        }
+    }
+
+    for (const auto &[name, cells] : {std::pair{"unique", &unique}, std::pair{"filled-down", &filled}})
+    {
+        std::cerr << "  " << cells->size() << " cells, " << name << " formulas:" << std::endl;
+        double single_thread{0};
+        for (size_t threads : {1, 2, 4, 8, 16})
+        {
+            Sheet sheet;
+            sheet.SetThreadCount(threads);
+            const auto start = std::chrono::steady_clock::now();
+            sheet.SetCells(*cells);
+            const std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - start;
+            if (threads == 1)
+                single_thread = ms.count();
+            std::cerr << "    " << threads << " threads: " << ms.count() << " ms, speedup "
+                      << single_thread / ms.count() << std::endl;
+        }
+
+        // share of the import which runs in parallel, the graph and the table are updated serially
+        std::vector<std::pair<Position, std::string_view>> expressions;
+        for (const auto &[pos, text] : *cells)
+        {
+            if (Cell::IsFormulaText(text))
+                expressions.emplace_back(pos, std::string_view(text).substr(1));
+        }
+        FormulaCache cache;
+        LOG_DURATION("parsing alone, 1 thread");
+        DoNotOptimize(cache.ParseFormulas(expressions, nullptr).size());
+    }
+    std::cerr << "  hardware threads: " << ThreadPool::DefaultThreadCount() << std::endl;
+}
+
+void BenchmarkParallelRecalculation()
+{
+    // levels of formulas over the level above, every one depends on the input in A1
+    constexpr int levels = 50, width = 2000;
+    std::vector<std::pair<Position, std::string>> cells{{Position{0, 0}, "1"}};
+    for (int col = 1; col < width; ++col)
+        cells.emplace_back(Position{0, col}, "=A1*" + std::to_string(col));
+    for (int row = 1; row < levels; ++row)
+    {
+        for (int col = 0; col < width; ++col)
+        {
+            const Position above{row - 1, col}, left{row - 1, std::max(col - 1, 0)};
+            cells.emplace_back(Position{row, col}, "=MIN(" + above.ToString() + "*" + above.ToString() + "/(" +
+                                                       left.ToString() + "+1),1000)/3+MAX(" + left.ToString() + ",1)");
+        }
+    }
+    Sheet sheet;
+    sheet.SetCells(std::move(cells));
+    sheet.Recalculate();
+
+    std::cerr << "  " << levels * width << " formulas in " << levels << " levels:" << std::endl;
+    double single_thread{0};
+    for (size_t threads : {1, 2, 4, 8, 16})
+    {
+        sheet.SetThreadCount(threads);
+        sheet.SetCell(Position{0, 0}, std::to_string(threads + 1));
+        const RecalculationStats stats = sheet.Recalculate();
+        const double ms = std::chrono::duration<double, std::milli>(stats.duration).count();
+        if (threads == 1)
+            single_thread = ms;
+        std::cerr << "    " << threads << " threads: " << stats.recomputed_cells << " cells in " << ms
+                  << " ms, speedup " << single_thread / ms << std::endl;
+    }
+    std::cerr << "  hardware threads: " << ThreadPool::DefaultThreadCount() << std::endl;
+}
+
+void BenchmarkConcurrentReads()
+{
+    // 20000 formulas over a column of inputs, values are read cell by cell under the read lock
+    constexpr int rows = 200, cols = 100, rounds = 20;
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < rows; ++row)
+    {
+        cells.emplace_back(Position{row, 0}, std::to_string(row));
+        for (int col = 1; col < cols; ++col)
+        {
+            cells.emplace_back(Position{row, col}, "=" + Position{row, col - 1}.ToString() + "*2+MAX(A1:" +
+                                                       Position{row, 0}.ToString() + ")");
+        }
+    }
+    auto read_all = [](const Sheet &sheet, int times) {
+        double sum{0};
+        for (int i = 0; i < times; ++i)
+        {
+            const Sheet::ReadLock lock = sheet.LockForReading();
+            for (int row = 0; row < rows; ++row)
+            {
+                for (int col = 0; col < cols; ++col)
+                {
+                    const auto value = sheet.GetCell({row, col})->GetValue();
+                    if (const double *number = std::get_if<double>(&value))
+                        sum += *number;
+                }
+            }
+        }
+        DoNotOptimize(sum);
+    };
+
+    // every reader reads the whole sheet `times` times, returns milliseconds and the number of writes done meanwhile
+    auto run = [&read_all](Sheet &sheet, size_t threads, int times, bool with_writer) {
+        std::vector<std::thread> readers;
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < threads; ++i)
+            readers.emplace_back(read_all, std::cref(sheet), times);
+        int writes{0};
+        for (; with_writer && writes < 200; ++writes)
+        {
+            sheet.SetCell(Position{rows + 1, 0}, std::to_string(writes));
+            std::this_thread::yield();
+        }
+        for (auto &reader : readers)
+            reader.join();
+        const std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - start;
+        return std::pair{ms.count(), writes};
+    };
+
+    for (const bool with_writer : {false, true})
+    {
+        std::cerr << "  " << (with_writer ? "with a writer changing an unrelated cell:" : "readers only:")
+                  << std::endl;
+        for (size_t threads : {1, 2, 4, 8})
+        {
+            Sheet sheet;
+            sheet.SetCells(cells);
+            // readers race to fill the same formula caches
+            const auto [cold_ms, cold_writes] = run(sheet, threads, 1, with_writer);
+            const auto [warm_ms, warm_writes] = run(sheet, threads, rounds, with_writer);
+            const double reads = static_cast<double>(threads) * rounds * rows * cols;
+            std::cerr << "    " << threads << " readers: first read " << cold_ms << " ms, then "
+                      << reads / warm_ms / 1000 << " M reads/s";
+            if (with_writer)
+                std::cerr << ", " << cold_writes + warm_writes << " writes";
+            std::cerr << std::endl;
+        }
+    }
+    std::cerr << "  hardware threads: " << ThreadPool::DefaultThreadCount() << std::endl;
+}
+
+void BenchmarkSnapshot()
+{
+    // 1000 x 1000 cells, every other column is a formula over its left neighbour
+    constexpr int rows = 1000, cols = 1000, edits = 1000;
+    std::vector<std::pair<Position, std::string>> cells;
+    cells.reserve(rows * cols);
+    for (int row = 0; row < rows; ++row)
+    {
+        for (int col = 0; col < cols; ++col)
+        {
+            if (col % 2 == 0)
+                cells.emplace_back(Position{row, col}, std::to_string(row + col));
+            else
+                cells.emplace_back(Position{row, col}, "=" + Position{row, col - 1}.ToString() + "*2");
+        }
+    }
+    std::mt19937 generator(42);
+    std::vector<Position> edited;
+    for (int i = 0; i < edits; ++i)
+        edited.push_back({static_cast<int>(generator() % rows), static_cast<int>(generator() % (cols / 2)) * 2});
+
+    const size_t bytes_before = allocated_bytes;
+    Sheet sheet;
+    sheet.SetThreadCount(1);
+    sheet.SetCells(std::move(cells));
+    sheet.Recalculate();
+    std::cerr << "  " << rows * cols << " cells, sheet: " << (allocated_bytes - bytes_before) / (1 << 20) << " MiB"
+              << std::endl;
+
+    // edits are measured without a snapshot first, then while snapshots keep the tiles they touch
+    auto edit = [&sheet, &edited](int round) {
+        const size_t bytes = allocated_bytes;
+        const auto start = std::chrono::steady_clock::now();
+        for (Position pos : edited)
+            sheet.SetCell(pos, std::to_string(round));
+        sheet.Recalculate();
+        const std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - start;
+        std::cerr << ms.count() << " ms, heap grew by " << static_cast<double>(allocated_bytes - bytes) / (1 << 20)
+                  << " MiB" << std::endl;
+    };
+    std::cerr << "    " << edits << " edits without snapshots: ";
+    edit(-1);
+
+    std::vector<std::shared_ptr<const SheetSnapshot>> snapshots;
+    for (int round = 0; round < 3; ++round)
+    {
+        const size_t bytes = allocated_bytes, allocations = allocations_count;
+        const auto start = std::chrono::steady_clock::now();
+        snapshots.push_back(sheet.Snapshot());
+        const std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - start;
+        std::cerr << "    snapshot " << round + 1 << ": " << ms.count() << " ms, " << allocations_count - allocations
+                  << " allocations, " << allocated_bytes - bytes << " bytes" << std::endl;
+        std::cerr << "    " << edits << " edits with " << round + 1 << " snapshots: ";
+        edit(round);
+    }
+
+    const size_t bytes = allocated_bytes;
+    snapshots.clear();
+    std::cerr << "    releasing the snapshots freed " << static_cast<double>(bytes - allocated_bytes) / (1 << 20)
+              << " MiB" << std::endl;
+}
+
+void BenchmarkCellFootprint()
+{
+    // 10000 x 1000 cells of one kind, heap bytes of the whole sheet once the formulas are evaluated
+    constexpr int rows = 10000, cols = 1000;
+    const std::pair<const char *, std::function<std::string(int, int)>> workloads[] = {
+        {"numbers", [](int row, int col) { return std::to_string(row * cols + col); }},
+        {"short texts", [](int row, int col) { return "item " + std::to_string(row + col); }},
+        {"long texts",
+         [](int row, int col) { return "a text which does not fit into a cell " + std::to_string(row + col); }},
+        {"numbers, every 100th cell a formula",
+         [](int row, int col) {
+             if ((row * cols + col) % 100 != 99)
+                 return std::to_string(row + col);
+             return "=" + Position{row, col - 1}.ToString() + "*2+" + Position{row, col - 2}.ToString();
+         }},
+    };
+    std::cerr << "  " << rows * cols << " cells:" << std::endl;
+    for (const auto &[name, make_text] : workloads)
+    {
+        const size_t bytes_before = allocated_bytes;
+        const auto start = std::chrono::steady_clock::now();
+        {
+            Sheet sheet;
+            sheet.SetThreadCount(1);
+            for (int row = 0; row < rows; ++row)
+            {
+                for (int col = 0; col < cols; ++col)
+                    sheet.SetCell({row, col}, make_text(row, col));
+            }
+            sheet.Recalculate();
+            std::cerr << "    " << name << ": " << static_cast<double>(allocated_bytes - bytes_before) / (rows * cols)
+                      << " bytes per cell";
+        }
+        const std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+        std::cerr << ", " << seconds.count() << " s" << std::endl;
+    }
+}
+
+void BenchmarkSparseReferences()
+{
+    // formulas in the first columns sum cells scattered over the whole sheet, few of which are set
+    constexpr int formulas = 20000, refs_per_formula = 8, values = 1000;
+    std::mt19937 generator(42);
+    std::uniform_int_distribution<int> row(0, Position::MAX_ROWS - 1), col(10, Position::MAX_COLS - 1);
+
+    const size_t bytes_before = allocated_bytes;
+    {
+        Sheet sheet;
+        sheet.SetThreadCount(1);
+        {
+            LOG_DURATION("set formulas");
+            for (int i = 0; i < formulas; ++i)
+            {
+                std::string text = "=";
+                for (int k = 0; k < refs_per_formula; ++k)
+                    text += (k ? "+" : "") + Position{row(generator), col(generator)}.ToString();
+                sheet.SetCell({i % Position::MAX_ROWS, i / Position::MAX_ROWS}, std::move(text));
+            }
+        }
+        {
+            LOG_DURATION("set values");
+            for (int i = 0; i < values; ++i)
+                sheet.SetCell({row(generator), col(generator)}, std::to_string(i));
+        }
+        {
+            LOG_DURATION("recalculate");
+            DoNotOptimize(sheet.Recalculate());
+        }
+        const Size size = sheet.GetPrintableSize();
+        std::cerr << "    " << sheet.GetCellCount() << " cells stored for " << formulas << " formulas over "
+                  << formulas * refs_per_formula << " references, printable area " << size.rows << " x " << size.cols
+                  << ", heap " << static_cast<double>(allocated_bytes - bytes_before) / (1 << 20) << " MiB"
+                  << std::endl;
+    }
+}
+
+void BenchmarkFormulaTrees()
+{
+    // distinct formulas kept alive together, the way a sheet keeps compiled formula bodies
+    constexpr int formulas_count = 500000;
+    std::vector<std::string> texts;
+    texts.reserve(formulas_count);
+    for (int i = 0; i < formulas_count; ++i)
+    {
+        const std::string row = std::to_string(i % 100 + 1);
+        texts.push_back("(A" + row + "+B" + row + ")*" + std::to_string(i) + "-C" + row + "/(D" + row +
+                        "-2e3)+-MAX(E" + row + ":F" + row + ",A" + row + ")");
+    }
+    Sheet sheet;
+    for (int row = 0; row < 100; ++row)
+    {
+        for (int col = 0; col < 6; ++col)
+            sheet.SetCell({row, col}, std::to_string(row * 6 + col + 1));
+    }
+
+    std::vector<FormulaAST> formulas;
+    formulas.reserve(formulas_count);
+    const size_t bytes_before = allocated_bytes, allocations_before = allocations_count, rss_before = ResidentBytes();
+    {
+        LOG_DURATION("parse " + std::to_string(formulas_count) + " formulas");
+        for (const auto &text : texts)
+            formulas.push_back(ParseFormulaAST(text));
+    }
+    std::cerr << "    " << static_cast<double>(allocated_bytes - bytes_before) / formulas_count << " heap bytes and "
+              << static_cast<double>(allocations_count - allocations_before) / formulas_count
+              << " allocations per formula, RSS grew by " << (ResidentBytes() - rss_before) / (1 << 20) << " MiB"
+              << std::endl;
+    for (auto [name, tree] : {std::pair{"evaluate the trees", true}, std::pair{"evaluate the bytecode", false}})
+    {
+        LOG_DURATION(name);
+        double sum{0};
+        for (const auto &formula : formulas)
+            sum += std::get<double>(tree ? formula.ExecuteTree(sheet) : formula.Execute(sheet));
+        DoNotOptimize(sum);
+    }
+}
+
+void BenchmarkConstantFolding()
+{
+    // shapes our generators produce, some with literal subexpressions, some without
+    const std::vector<std::function<std::string(const std::string &)>> shapes{
+        [](const std::string &row) { return "A" + row + "*(1+0.05)/12"; },
+        [](const std::string &row) { return "+(-(-3))+B" + row; },
+        [](const std::string &row) { return "B" + row + "*12*(1-0.2)"; },
+        [](const std::string &row) { return "(A" + row + "+B" + row + ")*1.5-C" + row + "/(D" + row + "-2e3)"; },
+        [](const std::string &row) { return "SUM(A" + row + ":D" + row + ")*(1+0.2)"; },
+        [](const std::string &row) { return "A" + row + "/(12*100)+-(-C" + row + ")"; },
+        [](const std::string &row) { return "MAX(0,A" + row + "-B" + row + ")*(365/12)"; },
+        [](const std::string &row) { return "(A" + row + "-B" + row + ")/(1+0.07)/(1+0.07)"; },
+        [](const std::string &row) { return "A" + row + "*B" + row + "+C" + row; },
+        [](const std::string &row) { return "SUM(A" + row + ",B" + row + ",2*3)/COUNT(1,2,3)"; },
+    };
+    constexpr int formulas_count = 100000, passes = 20;
+    Sheet sheet;
+    for (int row = 0; row < 1000; ++row)
+    {
+        for (int col = 0; col < 4; ++col)
+            sheet.SetCell({row, col}, std::to_string(row + col + 1));
+    }
+    std::vector<FormulaAST> formulas;
+    formulas.reserve(formulas_count);
+    size_t nodes{0}, instructions{0};
+    for (int i = 0; i < formulas_count; ++i)
+    {
+        formulas.push_back(ParseFormulaAST(shapes[i % shapes.size()](std::to_string(i / shapes.size() % 1000 + 1))));
+        const auto &tree = formulas.back().GetTree();
+        // every node but ranges would be an instruction without folding
+        nodes += std::count_if(tree.nodes.begin(), tree.nodes.end(),
+                               [](const ASTImpl::Node &node) { return node.type != ASTImpl::NodeType::Range; });
+        instructions += formulas.back().GetBytecode().code.size();
+    }
+    std::cerr << "    " << formulas_count << " formulas of " << shapes.size() << " shapes: " << nodes - instructions
+              << " of " << nodes << " nodes eliminated ("
+              << static_cast<double>(nodes - instructions) * 100 / nodes << "%)" << std::endl;
+    {
+        LOG_DURATION(std::to_string(passes) + " evaluations of every formula");
+        double sum{0};
+        for (int pass = 0; pass < passes; ++pass)
+        {
+            for (const auto &formula : formulas)
+                sum += std::get<double>(formula.Execute(sheet));
+        }
+        DoNotOptimize(sum);
+    }
+}
+
+void BenchmarkBoundReferences()
+{
+    // every formula reads the input in A1, cells of a dense block and cells scattered over sparse tiles
+    constexpr int block = 256, scattered = 2000, formulas = 50000, dense_refs = 11, sparse_refs = 4, rounds = 10;
+    constexpr int refs_per_formula = 1 + dense_refs + sparse_refs;
+    std::mt19937 generator(42);
+    std::uniform_int_distribution<int> block_pos(0, block - 1), scattered_index(0, scattered - 1);
+    std::uniform_int_distribution<int> far_row(block, Position::MAX_ROWS - 1), far_col(block, Position::MAX_COLS - 1);
+
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < block; ++row)
+    {
+        for (int col = 0; col < block; ++col)
+            cells.emplace_back(Position{row, col}, std::to_string(row + col));
+    }
+    std::vector<Position> far;
+    for (int i = 0; i < scattered; ++i)
+    {
+        far.push_back({far_row(generator), far_col(generator)});
+        cells.emplace_back(far.back(), std::to_string(i));
+    }
+    for (int i = 0; i < formulas; ++i)
+    {
+        std::string text = "=A1";
+        for (int k = 0; k < dense_refs; ++k)
+            text += "+" + Position{block_pos(generator), block_pos(generator)}.ToString();
+        for (int k = 0; k < sparse_refs; ++k)
+            text += "-" + far[scattered_index(generator)].ToString();
+        cells.emplace_back(Position{i % 5000, block + i / 5000}, std::move(text));
+    }
+    Sheet sheet;
+    sheet.SetThreadCount(1);
+    sheet.SetCells(std::move(cells));
+
+    auto recalculate = [&sheet](int input) {
+        sheet.SetCell(Position{0, 0}, std::to_string(input));
+        return std::chrono::duration<double, std::milli>(sheet.Recalculate().duration).count();
+    };
+    const double first = recalculate(1);
+    double total{0};
+    for (int round = 0; round < rounds; ++round)
+        total += recalculate(round + 2);
+    std::cerr << "  " << formulas << " formulas over " << refs_per_formula << " cells each, first recalculation "
+              << first << " ms, then " << total / rounds << " ms per recalculation, "
+              << total / rounds * 1e6 / formulas << " ns per formula" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    BenchmarkRunner br(argc, argv);
+    RUN_BENCHMARK(br, BenchmarkCellStorage);
+    RUN_BENCHMARK(br, BenchmarkFlatPositionMap);
+    RUN_BENCHMARK(br, BenchmarkBulkClear);
+    RUN_BENCHMARK(br, BenchmarkFormulaEvaluation);
+    RUN_BENCHMARK(br, BenchmarkFormulaParsing);
+    RUN_BENCHMARK(br, BenchmarkRecalculation);
+    RUN_BENCHMARK(br, BenchmarkCycleDetection);
+    RUN_BENCHMARK(br, BenchmarkDeepChainEvaluation);
+    RUN_BENCHMARK(br, BenchmarkRangeSum);
+    RUN_BENCHMARK(br, BenchmarkErrorPropagation);
+    RUN_BENCHMARK(br, BenchmarkPrintValues);
+    RUN_BENCHMARK(br, BenchmarkPrintTexts);
+    RUN_BENCHMARK(br, BenchmarkReferencedCells);
+    RUN_BENCHMARK(br, BenchmarkFilledColumns);
+    RUN_BENCHMARK(br, BenchmarkBulkImport);
+    RUN_BENCHMARK(br, BenchmarkParallelImport);
+    RUN_BENCHMARK(br, BenchmarkParallelRecalculation);
+    RUN_BENCHMARK(br, BenchmarkConcurrentReads);
+    RUN_BENCHMARK(br, BenchmarkSnapshot);
+    RUN_BENCHMARK(br, BenchmarkCellFootprint);
+    RUN_BENCHMARK(br, BenchmarkSparseReferences);
+    RUN_BENCHMARK(br, BenchmarkFormulaTrees);
+    RUN_BENCHMARK(br, BenchmarkConstantFolding);
+    RUN_BENCHMARK(br, BenchmarkBoundReferences);
+
+    return 0;
+}
@@ -4,11 +4,17 @@
 #include "../antlr/Formula/FormulaLexer.h"
 #include "../antlr/Formula/FormulaParser.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <utility>
 
 namespace ASTImpl
 {
@@ -81,281 +87,755 @@ constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
     {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 };
 
-class Expr
+// Writes the canonical text of a formula, references become slots of the template
+class TemplateWriter
 {
   public:
-    virtual ~Expr() = default;
-
-    virtual void Print(std::ostream &out) const = 0;
-
-    virtual void DoPrintFormula(std::ostream &out, ExprPrecedence precedence) const = 0;
+    explicit TemplateWriter(TextTemplate &result) : result_(result)
+    {
+    }
 
-    virtual double Evaluate(const SheetInterface &sheet) const = 0;
+    TemplateWriter &operator<<(char ch)
+    {
+        result_.text += ch;
+        return *this;
+    }
 
-    // higher is tighter
-    virtual ExprPrecedence GetPrecedence() const = 0;
+    TemplateWriter &operator<<(std::string_view text)
+    {
+        result_.text += text;
+        return *this;
+    }
 
-    void PrintFormula(std::ostream &out, ExprPrecedence parent_precedence, bool right_child = false) const
+    // Same format as printing to a default std::ostream
+    TemplateWriter &operator<<(double value)
     {
-        auto precedence = GetPrecedence();
-        auto mask = right_child ? PR_RIGHT : PR_LEFT;
-        bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
-        if (parens_needed)
-        {
-            out << '(';
-        }
+        char buffer[32];
+        std::snprintf(buffer, sizeof(buffer), "%g", value);
+        result_.text += buffer;
+        return *this;
+    }
 
-        DoPrintFormula(out, precedence);
+    void AddCell(uint32_t index)
+    {
+        result_.slots.push_back({static_cast<uint32_t>(result_.text.size()), index, false});
+    }
 
-        if (parens_needed)
-        {
-            out << ')';
-        }
+    void AddRange(uint32_t index)
+    {
+        result_.slots.push_back({static_cast<uint32_t>(result_.text.size()), index, true});
     }
+
+  private:
+    TextTemplate &result_;
 };
 
 namespace
 {
-class BinaryOpExpr final : public Expr
+bool IsError(const EvaluationResult &result)
 {
-  public:
-    enum Type : char
+    return std::holds_alternative<FormulaError>(result);
+}
+
+EvaluationResult CheckFinite(double result)
+{
+    if (std::isfinite(result))
+        return result;
+    return FormulaError(FormulaError::Category::Div0);
+}
+
+EvaluationResult ReadCellValue(const SheetInterface &sheet, Position pos)
+{
+    if (!pos.IsValid())
+        return FormulaError(FormulaError::Category::Ref);
+    const CellInterface *cell = sheet.GetCell(pos);
+    if (!cell)
+        return 0.0;
+
+    if (auto value = cell->GetNumericValue())
+        return *value;
+    return 0.0;
+}
+
+struct FunctionName
+{
+    Function function;
+    std::string_view name;
+};
+
+constexpr FunctionName FUNCTION_NAMES[] = {
+    {Function::Sum, "SUM"}, {Function::Average, "AVERAGE"}, {Function::Min, "MIN"},
+    {Function::Max, "MAX"}, {Function::Count, "COUNT"},
+};
+
+std::string_view GetFunctionName(Function function)
+{
+    for (const auto &entry : FUNCTION_NAMES)
     {
-        Add = '+',
-        Subtract = '-',
-        Multiply = '*',
-        Divide = '/',
-    };
+        if (entry.function == function)
+            return entry.name;
+    }
+    assert(false);
+    return {};
+}
+
+std::optional<Function> FindFunction(std::string_view name)
+{
+    for (const auto &entry : FUNCTION_NAMES)
+    {
+        if (entry.name == name)
+            return entry.function;
+    }
+    return std::nullopt;
+}
+
+// Reduction kernels keep KERNEL_LANES independent partial results,
+// so that the loops are vectorized without reassociating a single accumulator
+constexpr size_t KERNEL_LANES = 8;
 
+double SumKernel(const double *values, size_t size)
+{
+    double lanes[KERNEL_LANES] = {};
+    size_t i = 0;
+    for (; i + KERNEL_LANES <= size; i += KERNEL_LANES)
+    {
+        for (size_t lane = 0; lane < KERNEL_LANES; ++lane)
+            lanes[lane] += values[i + lane];
+    }
+    double result{0};
+    for (double lane : lanes)
+        result += lane;
+    for (; i < size; ++i)
+        result += values[i];
+    return result;
+}
+
+double MinKernel(const double *values, size_t size, double init)
+{
+    double lanes[KERNEL_LANES];
+    std::fill(std::begin(lanes), std::end(lanes), init);
+    size_t i = 0;
+    for (; i + KERNEL_LANES <= size; i += KERNEL_LANES)
+    {
+        for (size_t lane = 0; lane < KERNEL_LANES; ++lane)
+            lanes[lane] = values[i + lane] < lanes[lane] ? values[i + lane] : lanes[lane];
+    }
+    double result = init;
+    for (double lane : lanes)
+        result = std::min(result, lane);
+    for (; i < size; ++i)
+        result = std::min(result, values[i]);
+    return result;
+}
+
+double MaxKernel(const double *values, size_t size, double init)
+{
+    double lanes[KERNEL_LANES];
+    std::fill(std::begin(lanes), std::end(lanes), init);
+    size_t i = 0;
+    for (; i + KERNEL_LANES <= size; i += KERNEL_LANES)
+    {
+        for (size_t lane = 0; lane < KERNEL_LANES; ++lane)
+            lanes[lane] = values[i + lane] > lanes[lane] ? values[i + lane] : lanes[lane];
+    }
+    double result = init;
+    for (double lane : lanes)
+        result = std::max(result, lane);
+    for (; i < size; ++i)
+        result = std::max(result, values[i]);
+    return result;
+}
+} // namespace
+
+// Running state of an aggregate function.
+// Values are gathered into a contiguous chunk and reduced by the kernels chunk by chunk.
+// Empty cells of ranges are skipped; COUNT also skips text and errors, other functions
+// read cells of ranges like cell references do. The first error becomes the result
+class Aggregator
+{
   public:
-    explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
-        : type_(type), lhs_(std::move(lhs)), rhs_(std::move(rhs))
+    explicit Aggregator(Function function) : function_(function)
     {
     }
 
-    void Print(std::ostream &out) const override
+    void Add(double value)
     {
-        out << '(' << static_cast<char>(type_) << ' ';
-        lhs_->Print(out);
-        out << ' ';
-        rhs_->Print(out);
-        out << ')';
+        chunk_[chunk_size_++] = value;
+        if (chunk_size_ == CHUNK_SIZE)
+            Flush();
     }
 
-    void DoPrintFormula(std::ostream &out, ExprPrecedence precedence) const override
+    void AddResult(const EvaluationResult &result)
     {
-        lhs_->PrintFormula(out, precedence);
-        out << static_cast<char>(type_);
-        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+        if (const double *number = std::get_if<double>(&result))
+            Add(*number);
+        else
+            SetError(std::get<FormulaError>(result));
     }
 
-    ExprPrecedence GetPrecedence() const override
+    void AddRange(const SheetInterface &sheet, Range range)
     {
-        switch (type_)
+        for (int row = range.first.row; row <= range.last.row && !error_; ++row)
         {
-        case Add:
-            return EP_ADD;
-        case Subtract:
-            return EP_SUB;
-        case Multiply:
-            return EP_MUL;
-        case Divide:
-            return EP_DIV;
-        default:
-            // have to do this because VC++ has a buggy warning
-            assert(false);
-            return static_cast<ExprPrecedence>(INT_MAX);
+            for (int col = range.first.col; col <= range.last.col && !error_; ++col)
+            {
+                const CellInterface *cell = sheet.GetCell({row, col});
+                if (cell)
+                    AddCellValue(cell->GetNumericValue());
+            }
         }
     }
 
-    double Evaluate(const SheetInterface &sheet) const override
+    EvaluationResult Result()
     {
-        double left = lhs_->Evaluate(sheet), right = rhs_->Evaluate(sheet), result;
-        switch (type_)
+        if (error_)
+            return *error_;
+        Flush();
+        switch (function_)
         {
-        case Subtract:
-            result = left - right;
+        case Function::Sum:
+            return CheckFinite(sum_);
+        case Function::Average:
+            return CheckFinite(sum_ / count_);
+        case Function::Min:
+            return count_ ? min_ : 0.0;
+        case Function::Max:
+            return count_ ? max_ : 0.0;
+        case Function::Count:
+            return static_cast<double>(count_);
+        }
+        assert(false);
+        return 0.0;
+    }
+
+  private:
+    static constexpr size_t CHUNK_SIZE = 256;
+
+    Function function_;
+    double chunk_[CHUNK_SIZE];
+    size_t chunk_size_{0};
+    size_t count_{0};
+    double sum_{0};
+    double min_{std::numeric_limits<double>::infinity()};
+    double max_{-std::numeric_limits<double>::infinity()};
+    std::optional<FormulaError> error_;
+
+    void SetError(FormulaError error)
+    {
+        if (!error_)
+            error_ = error;
+    }
+
+    // Empty values are skipped, COUNT skips non-numeric text and errors as well
+    void AddCellValue(const std::optional<NumericValue> &value)
+    {
+        if (!value)
+            return;
+        if (const double *number = std::get_if<double>(&*value))
+            Add(*number);
+        else if (function_ != Function::Count)
+            SetError(std::get<FormulaError>(*value));
+    }
+
+    void Flush()
+    {
+        count_ += chunk_size_;
+        switch (function_)
+        {
+        case Function::Sum:
+        case Function::Average:
+            sum_ += SumKernel(chunk_, chunk_size_);
             break;
-        case Add:
-            result = left + right;
+        case Function::Min:
+            min_ = MinKernel(chunk_, chunk_size_, min_);
             break;
-        case Multiply:
-            result = left * right;
+        case Function::Max:
+            max_ = MaxKernel(chunk_, chunk_size_, max_);
             break;
-        case Divide:
-            result = left / right;
+        case Function::Count:
+            break;
+        }
+        chunk_size_ = 0;
+    }
+};
+
+namespace
+{
+// Maximum number of values on the stack while running the code
+size_t StackDepth(const Bytecode &bytecode)
+{
+    size_t depth{0}, max_depth{0};
+    for (const auto &instruction : bytecode.code)
+    {
+        switch (instruction.code)
+        {
+        case OpCode::PushNumber:
+        case OpCode::PushCell:
+            max_depth = std::max(max_depth, ++depth);
+            break;
+        case OpCode::Negate:
+            break;
+        case OpCode::Call:
+            depth = depth - bytecode.calls[instruction.operand].scalar_count + 1;
+            max_depth = std::max(max_depth, depth);
             break;
         default:
-            assert(false);
-            return 0;
+            --depth;
         }
-        if (std::isfinite(result))
-            return result;
-        throw FormulaError(FormulaError::Category::Div0);
     }
+    return max_depth;
+}
 
-  private:
-    Type type_;
-    std::unique_ptr<Expr> lhs_;
-    std::unique_ptr<Expr> rhs_;
-};
+ExprPrecedence GetPrecedence(NodeType type)
+{
+    switch (type)
+    {
+    case NodeType::Add:
+        return EP_ADD;
+    case NodeType::Subtract:
+        return EP_SUB;
+    case NodeType::Multiply:
+        return EP_MUL;
+    case NodeType::Divide:
+        return EP_DIV;
+    case NodeType::UnaryPlus:
+    case NodeType::UnaryMinus:
+        return EP_UNARY;
+    default:
+        return EP_ATOM;
+    }
+}
 
-class UnaryOpExpr final : public Expr
+char GetSign(NodeType type)
 {
-  public:
-    enum Type : char
+    switch (type)
     {
-        UnaryPlus = '+',
-        UnaryMinus = '-',
-    };
+    case NodeType::Add:
+    case NodeType::UnaryPlus:
+        return '+';
+    case NodeType::Subtract:
+    case NodeType::UnaryMinus:
+        return '-';
+    case NodeType::Multiply:
+        return '*';
+    case NodeType::Divide:
+        return '/';
+    default:
+        assert(false);
+        return '?';
+    }
+}
 
+// Collects nodes and references met by a parser. Operands are added before the operation using
+// them, so the tree comes out in postfix order. References get their indices when Build() sorts
+// and deduplicates them
+class TreeBuilder
+{
   public:
-    explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand) : type_(type), operand_(std::move(operand))
+    uint32_t AddNumber(double value)
     {
+        tree_.numbers.push_back(value);
+        return Add({NodeType::Number, {}, static_cast<uint32_t>(tree_.numbers.size() - 1), 0});
     }
 
-    void Print(std::ostream &out) const override
+    uint32_t AddCell(Position pos)
     {
-        out << '(' << static_cast<char>(type_) << ' ';
-        operand_->Print(out);
-        out << ')';
+        cells_.emplace_back(pos, static_cast<uint32_t>(tree_.nodes.size()));
+        return Add({NodeType::Cell, {}, 0, 0});
     }
 
-    void DoPrintFormula(std::ostream &out, ExprPrecedence precedence) const override
+    uint32_t AddRange(Range range)
     {
-        out << static_cast<char>(type_);
-        operand_->PrintFormula(out, precedence);
+        ranges_.emplace_back(range, static_cast<uint32_t>(tree_.nodes.size()));
+        return Add({NodeType::Range, {}, 0, 0});
     }
 
-    ExprPrecedence GetPrecedence() const override
+    uint32_t AddUnary(NodeType type, uint32_t operand)
     {
-        return EP_UNARY;
+        return Add({type, {}, operand, 0});
     }
 
-    double Evaluate(const SheetInterface &sheet) const override
+    uint32_t AddBinary(NodeType type, uint32_t lhs, uint32_t rhs)
     {
-        switch (type_)
-        {
-        case UnaryPlus:
-            return operand_->Evaluate(sheet);
-        case UnaryMinus:
-            return -operand_->Evaluate(sheet);
-        default:
-            throw std::runtime_error("Operation does not exist");
-        }
+        return Add({type, {}, lhs, rhs});
+    }
+
+    uint32_t AddCall(Function function, const std::vector<uint32_t> &args)
+    {
+        const auto first = static_cast<uint32_t>(tree_.arguments.size());
+        tree_.arguments.insert(tree_.arguments.end(), args.begin(), args.end());
+        return Add({NodeType::Call, function, first, static_cast<uint32_t>(args.size())});
+    }
+
+    // The root is the last node added, the builder is left empty
+    std::pair<Tree, References> Build()
+    {
+        References refs;
+        refs.cells = BuildArray(cells_);
+        refs.ranges = BuildArray(ranges_);
+        return {std::exchange(tree_, {}), std::move(refs)};
     }
 
   private:
-    Type type_;
-    std::unique_ptr<Expr> operand_;
+    Tree tree_;
+    std::vector<std::pair<Position, uint32_t>> cells_; // with the node of the reference
+    std::vector<std::pair<Range, uint32_t>> ranges_;
+
+    uint32_t Add(Node node)
+    {
+        tree_.nodes.push_back(node);
+        return static_cast<uint32_t>(tree_.nodes.size() - 1);
+    }
+
+    template <typename T> std::vector<T> BuildArray(std::vector<std::pair<T, uint32_t>> &nodes)
+    {
+        std::vector<T> result;
+        result.reserve(nodes.size());
+        for (const auto &[value, node] : nodes)
+            result.push_back(value);
+        std::sort(result.begin(), result.end());
+        result.erase(std::unique(result.begin(), result.end()), result.end());
+        for (const auto &[value, node] : nodes)
+        {
+            auto index = std::lower_bound(result.begin(), result.end(), value) - result.begin();
+            tree_.nodes[node].first = static_cast<uint32_t>(index);
+        }
+        nodes.clear();
+        return result;
+    }
 };
 
-class CellExpr final : public Expr
+// Evaluates a tree recursively, kept as the reference for the bytecode
+class TreeWalker
 {
   public:
-    explicit CellExpr(const Position *cell) : pos_(cell)
+    TreeWalker(const Tree &tree, const SheetInterface &sheet, const References &refs)
+        : tree_(tree), sheet_(sheet), refs_(refs)
     {
     }
 
-    void Print(std::ostream &out) const override
+    EvaluationResult Evaluate(uint32_t index) const
     {
-        if (!pos_->IsValid())
+        const Node &node = tree_.nodes[index];
+        switch (node.type)
         {
-            out << FormulaError::Category::Ref;
+        case NodeType::Number:
+            return tree_.numbers[node.first];
+        case NodeType::Cell:
+            return ReadCellValue(sheet_, refs_.cells[node.first]);
+        case NodeType::Range:
+            // the parser accepts ranges only as arguments of functions
+            assert(false);
+            return FormulaError(FormulaError::Category::Value);
+        case NodeType::UnaryPlus:
+            return Evaluate(node.first);
+        case NodeType::UnaryMinus: {
+            EvaluationResult result = Evaluate(node.first);
+            if (double *value = std::get_if<double>(&result))
+                *value = -*value;
+            return result;
         }
-        else
+        case NodeType::Call:
+            return EvaluateCall(node);
+        default:
+            return EvaluateBinary(node);
+        }
+    }
+
+  private:
+    const Tree &tree_;
+    const SheetInterface &sheet_;
+    const References &refs_;
+
+    EvaluationResult EvaluateBinary(const Node &node) const
+    {
+        EvaluationResult lhs = Evaluate(node.first);
+        if (IsError(lhs))
+            return lhs;
+        EvaluationResult rhs = Evaluate(node.second);
+        if (IsError(rhs))
+            return rhs;
+        double left = std::get<double>(lhs), right = std::get<double>(rhs), result;
+        switch (node.type)
         {
-            out << pos_->ToString();
+        case NodeType::Subtract:
+            result = left - right;
+            break;
+        case NodeType::Add:
+            result = left + right;
+            break;
+        case NodeType::Multiply:
+            result = left * right;
+            break;
+        case NodeType::Divide:
+            result = left / right;
+            break;
+        default:
+            assert(false);
+            return 0.0;
         }
+        return CheckFinite(result);
     }
 
-    void DoPrintFormula(std::ostream &out, ExprPrecedence /* precedence */) const override
+    EvaluationResult EvaluateCall(const Node &node) const
     {
-        Print(out);
+        // scalar arguments first, like the bytecode does, so that the same error wins
+        const uint32_t *args = tree_.arguments.data() + node.first;
+        Aggregator aggregator(node.function);
+        for (uint32_t i = 0; i < node.second; ++i)
+        {
+            if (tree_.nodes[args[i]].type != NodeType::Range)
+                aggregator.AddResult(Evaluate(args[i]));
+        }
+        for (uint32_t i = 0; i < node.second; ++i)
+        {
+            const Node &arg = tree_.nodes[args[i]];
+            if (arg.type == NodeType::Range)
+                aggregator.AddRange(sheet_, refs_.ranges[arg.first]);
+        }
+        return aggregator.Result();
     }
+};
 
-    ExprPrecedence GetPrecedence() const override
+// Prefix notation with every operation in parentheses, for debugging
+void PrintTree(std::ostream &out, const Tree &tree, const References &refs, uint32_t index)
+{
+    const Node &node = tree.nodes[index];
+    switch (node.type)
     {
-        return EP_ATOM;
+    case NodeType::Number:
+        out << tree.numbers[node.first];
+        break;
+    case NodeType::Cell:
+        if (const Position &pos = refs.cells[node.first]; !pos.IsValid())
+        {
+            out << FormulaError::Category::Ref;
+        }
+        else
+        {
+            out << pos.ToString();
+        }
+        break;
+    case NodeType::Range:
+        out << refs.ranges[node.first].ToString();
+        break;
+    case NodeType::UnaryPlus:
+    case NodeType::UnaryMinus:
+        out << '(' << GetSign(node.type) << ' ';
+        PrintTree(out, tree, refs, node.first);
+        out << ')';
+        break;
+    case NodeType::Call:
+        out << '(' << GetFunctionName(node.function);
+        for (uint32_t i = 0; i < node.second; ++i)
+        {
+            out << ' ';
+            PrintTree(out, tree, refs, tree.arguments[node.first + i]);
+        }
+        out << ')';
+        break;
+    default:
+        out << '(' << GetSign(node.type) << ' ';
+        PrintTree(out, tree, refs, node.first);
+        out << ' ';
+        PrintTree(out, tree, refs, node.second);
+        out << ')';
     }
+}
 
-    double Evaluate(const SheetInterface &sheet) const override
+// Canonical text of the subtree, in parentheses where the parent needs them
+void PrintFormula(TemplateWriter &out, const Tree &tree, uint32_t index, ExprPrecedence parent_precedence,
+                  bool right_child = false)
+{
+    const Node &node = tree.nodes[index];
+    const ExprPrecedence precedence = GetPrecedence(node.type);
+    const auto mask = right_child ? PR_RIGHT : PR_LEFT;
+    const bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
+    if (parens_needed)
     {
-        if (!pos_->IsValid())
-            throw FormulaError(FormulaError::Category::Ref);
-        if (!sheet.GetCell(*pos_))
-            return 0.0;
+        out << '(';
+    }
 
-        auto value = sheet.GetCell(*pos_)->GetValue();
-        if (const double *pval = std::get_if<double>(&value))
-            return *pval;
-        else if (const std::string *str = std::get_if<std::string>(&value))
+    switch (node.type)
+    {
+    case NodeType::Number:
+        out << tree.numbers[node.first];
+        break;
+    case NodeType::Cell:
+        out.AddCell(node.first);
+        break;
+    case NodeType::Range:
+        out.AddRange(node.first);
+        break;
+    case NodeType::UnaryPlus:
+    case NodeType::UnaryMinus:
+        out << GetSign(node.type);
+        PrintFormula(out, tree, node.first, precedence);
+        break;
+    case NodeType::Call:
+        out << GetFunctionName(node.function) << '(';
+        for (uint32_t i = 0; i < node.second; ++i)
         {
-            if (str->empty())
-                return 0.0;
-            try
-            {
-                return std::stod(*str);
-            }
-            catch (...)
+            if (i != 0)
             {
-                throw FormulaError(FormulaError::Category::Value);
+                out << ',';
             }
+            PrintFormula(out, tree, tree.arguments[node.first + i], EP_ATOM);
         }
-
-        throw std::get<FormulaError>(value);
+        out << ')';
+        break;
+    default:
+        PrintFormula(out, tree, node.first, precedence);
+        out << GetSign(node.type);
+        PrintFormula(out, tree, node.second, precedence, /* right_child = */ true);
     }
 
-  private:
-    const Position *pos_;
-};
+    if (parens_needed)
+    {
+        out << ')';
+    }
+}
 
-class NumberExpr final : public Expr
+// Appends instructions to the code in tree order, folding constants on the way. An operation whose
+// operands all are constants becomes one constant, computed exactly as the evaluation would do it.
+// A result which is not finite is left to the evaluation, so that #DIV/0! comes up in the same order.
+// Unary plus and double negation are dropped. The text of the formula is printed from the tree,
+// it keeps every node
+class Compiler
 {
   public:
-    explicit NumberExpr(double value) : value_(value)
+    explicit Compiler(const Tree &tree) : tree_(tree)
     {
     }
 
-    void Print(std::ostream &out) const override
+    Bytecode Compile()
     {
-        out << value_;
+        bytecode_.code.reserve(tree_.nodes.size());
+        for (const Node &node : tree_.nodes)
+            Add(node);
+        bytecode_.stack_depth = StackDepth(bytecode_);
+        return std::move(bytecode_);
     }
 
-    void DoPrintFormula(std::ostream &out, ExprPrecedence /* precedence */) const override
+  private:
+    const Tree &tree_;
+    Bytecode bytecode_;
+
+    void Add(const Node &node)
     {
-        out << value_;
+        switch (node.type)
+        {
+        case NodeType::Number:
+            PushConstant(tree_.numbers[node.first]);
+            break;
+        case NodeType::Cell:
+            bytecode_.code.push_back({OpCode::PushCell, node.first});
+            break;
+        case NodeType::Range:
+        case NodeType::UnaryPlus:
+            break;
+        case NodeType::UnaryMinus:
+            if (EndsWithConstants(1))
+                bytecode_.constants.back() = -bytecode_.constants.back();
+            else if (bytecode_.code.back().code == OpCode::Negate)
+                bytecode_.code.pop_back();
+            else
+                bytecode_.code.push_back({OpCode::Negate, 0});
+            break;
+        case NodeType::Add:
+            AddBinary(OpCode::Add, [](double lhs, double rhs) { return lhs + rhs; });
+            break;
+        case NodeType::Subtract:
+            AddBinary(OpCode::Subtract, [](double lhs, double rhs) { return lhs - rhs; });
+            break;
+        case NodeType::Multiply:
+            AddBinary(OpCode::Multiply, [](double lhs, double rhs) { return lhs * rhs; });
+            break;
+        case NodeType::Divide:
+            AddBinary(OpCode::Divide, [](double lhs, double rhs) { return lhs / rhs; });
+            break;
+        case NodeType::Call:
+            AddCall(node);
+            break;
+        }
     }
 
-    ExprPrecedence GetPrecedence() const override
+    template <typename Operation> void AddBinary(OpCode code, Operation operation)
     {
-        return EP_ATOM;
+        if (EndsWithConstants(2))
+        {
+            const size_t size = bytecode_.constants.size();
+            const double result = operation(bytecode_.constants[size - 2], bytecode_.constants[size - 1]);
+            if (std::isfinite(result))
+            {
+                PopConstants(2);
+                PushConstant(result);
+                return;
+            }
+        }
+        bytecode_.code.push_back({code, 0});
     }
 
-    double Evaluate(const SheetInterface &sheet) const override
+    void AddCall(const Node &node)
     {
-        return value_;
+        FunctionCall call{node.function, 0, {}};
+        for (uint32_t i = 0; i < node.second; ++i)
+        {
+            const Node &arg = tree_.nodes[tree_.arguments[node.first + i]];
+            if (arg.type == NodeType::Range)
+                call.ranges.push_back(arg.first);
+            else
+                ++call.scalar_count;
+        }
+        if (call.ranges.empty() && EndsWithConstants(call.scalar_count))
+        {
+            Aggregator aggregator(call.function);
+            const size_t size = bytecode_.constants.size();
+            for (size_t i = size - call.scalar_count; i < size; ++i)
+                aggregator.Add(bytecode_.constants[i]);
+            if (const auto result = aggregator.Result(); !IsError(result))
+            {
+                PopConstants(call.scalar_count);
+                PushConstant(std::get<double>(result));
+                return;
+            }
+        }
+        bytecode_.calls.push_back(std::move(call));
+        bytecode_.code.push_back({OpCode::Call, static_cast<uint32_t>(bytecode_.calls.size() - 1)});
     }
 
-  private:
-    double value_;
+    // Constants are pushed in the order of the code, so the last count instructions pushing
+    // constants push the last count of them
+    bool EndsWithConstants(size_t count) const
+    {
+        const auto &code = bytecode_.code;
+        return count <= code.size() && std::all_of(code.end() - count, code.end(), [](const Instruction &instruction) {
+                   return instruction.code == OpCode::PushNumber;
+               });
+    }
+
+    void PushConstant(double value)
+    {
+        bytecode_.constants.push_back(value);
+        bytecode_.code.push_back({OpCode::PushNumber, static_cast<uint32_t>(bytecode_.constants.size() - 1)});
+    }
+
+    void PopConstants(size_t count)
+    {
+        bytecode_.constants.resize(bytecode_.constants.size() - count);
+        bytecode_.code.resize(bytecode_.code.size() - count);
+    }
 };
 
 class ParseASTListener final : public FormulaBaseListener
 {
   public:
-    std::unique_ptr<Expr> MoveRoot()
+    std::pair<Tree, References> Build()
     {
         assert(args_.size() == 1);
-        auto root = std::move(args_.front());
         args_.clear();
 
-        return root;
-    }
-
-    std::forward_list<Position> MoveCells()
-    {
-        return std::move(cells_);
+        return builder_.Build();
     }
 
   public:
@@ -363,21 +843,18 @@ class ParseASTListener final : public FormulaBaseListener
     {
         assert(args_.size() >= 1);
 
-        auto operand = std::move(args_.back());
-
-        UnaryOpExpr::Type type;
+        NodeType type;
         if (ctx->SUB())
         {
-            type = UnaryOpExpr::UnaryMinus;
+            type = NodeType::UnaryMinus;
         }
         else
         {
             assert(ctx->ADD() != nullptr);
-            type = UnaryOpExpr::UnaryPlus;
+            type = NodeType::UnaryPlus;
         }
 
-        auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-        args_.back() = std::move(node);
+        args_.back() = builder_.AddUnary(type, args_.back());
     }
 
     void exitLiteral(FormulaParser::LiteralContext *ctx) override
@@ -391,8 +868,7 @@ class ParseASTListener final : public FormulaBaseListener
             throw ParsingError("Invalid number: " + valueStr);
         }
 
-        auto node = std::make_unique<NumberExpr>(value);
-        args_.push_back(std::move(node));
+        args_.push_back(builder_.AddNumber(value));
     }
 
     void exitCell(FormulaParser::CellContext *ctx) override
@@ -404,41 +880,38 @@ class ParseASTListener final : public FormulaBaseListener
             throw FormulaException("Invalid position: " + value_str);
         }
 
-        cells_.push_front(value);
-        auto node = std::make_unique<CellExpr>(&cells_.front());
-        args_.push_back(std::move(node));
+        args_.push_back(builder_.AddCell(value));
     }
 
     void exitBinaryOp(FormulaParser::BinaryOpContext *ctx) override
     {
         assert(args_.size() >= 2);
 
-        auto rhs = std::move(args_.back());
+        auto rhs = args_.back();
         args_.pop_back();
 
-        auto lhs = std::move(args_.back());
+        auto lhs = args_.back();
 
-        BinaryOpExpr::Type type;
+        NodeType type;
         if (ctx->ADD())
         {
-            type = BinaryOpExpr::Add;
+            type = NodeType::Add;
         }
         else if (ctx->SUB())
         {
-            type = BinaryOpExpr::Subtract;
+            type = NodeType::Subtract;
         }
         else if (ctx->MUL())
         {
-            type = BinaryOpExpr::Multiply;
+            type = NodeType::Multiply;
         }
         else
         {
             assert(ctx->DIV() != nullptr);
-            type = BinaryOpExpr::Divide;
+            type = NodeType::Divide;
         }
 
-        auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-        args_.back() = std::move(node);
+        args_.back() = builder_.AddBinary(type, lhs, rhs);
     }
 
     void visitErrorNode(antlr4::tree::ErrorNode *node) override
@@ -447,8 +920,8 @@ class ParseASTListener final : public FormulaBaseListener
     }
 
   private:
-    std::vector<std::unique_ptr<Expr>> args_;
-    std::forward_list<Position> cells_;
+    std::vector<uint32_t> args_; // nodes of the operands met so far
+    TreeBuilder builder_;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener
@@ -462,9 +935,416 @@ class BailErrorListener : public antlr4::BaseErrorListener
     }
 };
 
+// Recursive-descent parser for the grammar in antlr/Formula.g4.
+// Tokens are views into the source text, so nothing is allocated
+// besides the tree itself. Builds the same tree as ParseASTListener
+// and reports errors with the same exception types.
+// Also accepts aggregate functions, which the ANTLR grammar lacks:
+//   NAME '(' arg (',' arg)* ')',  arg: RANGE | expr,  RANGE: CELL ':' CELL
+class HandWrittenParser
+{
+  public:
+    explicit HandWrittenParser(std::string_view text) : text_(text)
+    {
+    }
+
+    std::pair<Tree, References> Parse()
+    {
+        NextToken();
+        ParseAdditive();
+        if (token_ != Token::End)
+        {
+            throw ParsingError("Error when parsing: " + std::string(token_text_));
+        }
+        return builder_.Build();
+    }
+
+    // See MakeRelativeFormulaKey(), throws ParsingError on lexing errors
+    std::string MakeRelativeKey(Position anchor)
+    {
+        std::string key;
+        key.reserve(text_.size() * 2);
+        for (NextToken(); token_ != Token::End; NextToken())
+        {
+            if (!key.empty())
+            {
+                key += ' ';
+            }
+            if (token_ == Token::Cell)
+            {
+                AppendRelativeCell(key, token_text_, anchor);
+            }
+            else if (token_ == Token::Range)
+            {
+                const size_t colon = token_text_.find(':');
+                AppendRelativeCell(key, token_text_.substr(0, colon), anchor);
+                key += ':';
+                AppendRelativeCell(key, token_text_.substr(colon + 1), anchor);
+            }
+            else
+            {
+                key += token_text_;
+            }
+        }
+        return key;
+    }
+
+  private:
+    enum class Token
+    {
+        End,
+        Number,
+        Cell,
+        Range,
+        Name,
+        Comma,
+        Add,
+        Sub,
+        Mul,
+        Div,
+        LeftParen,
+        RightParen,
+    };
+
+    std::string_view text_;
+    size_t offset_{0};
+    Token token_{Token::End};
+    std::string_view token_text_;
+    TreeBuilder builder_;
+
+    static bool IsDigit(char ch)
+    {
+        return ch >= '0' && ch <= '9';
+    }
+
+    static bool IsLetter(char ch)
+    {
+        return ch >= 'A' && ch <= 'Z';
+    }
+
+    static bool IsSpace(char ch)
+    {
+        return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r';
+    }
+
+    size_t SkipLetters(size_t offset) const
+    {
+        while (offset < text_.size() && IsLetter(text_[offset]))
+        {
+            ++offset;
+        }
+        return offset;
+    }
+
+    // CELL: [A-Z]+[0-9]+, returns offset unchanged if there is none
+    size_t SkipCell(size_t offset) const
+    {
+        size_t digits = SkipLetters(offset);
+        size_t end = SkipDigits(digits);
+        return digits > offset && end > digits ? end : offset;
+    }
+
+    size_t SkipDigits(size_t offset) const
+    {
+        while (offset < text_.size() && IsDigit(text_[offset]))
+        {
+            ++offset;
+        }
+        return offset;
+    }
+
+    // EXPONENT: [eE] [-+]? UINT, returns offset unchanged if there is none
+    size_t SkipExponent(size_t offset) const
+    {
+        if (offset == text_.size() || (text_[offset] != 'e' && text_[offset] != 'E'))
+        {
+            return offset;
+        }
+        size_t digits = offset + 1;
+        if (digits < text_.size() && (text_[digits] == '+' || text_[digits] == '-'))
+        {
+            ++digits;
+        }
+        size_t end = SkipDigits(digits);
+        return end > digits ? end : offset;
+    }
+
+    static void AppendRelativeCell(std::string &key, std::string_view cell, Position anchor)
+    {
+        const Position pos = Position::FromString(cell);
+        if (!pos.IsValid())
+        {
+            key += cell;
+            return;
+        }
+        key += 'R';
+        key += std::to_string(pos.row - anchor.row);
+        key += 'C';
+        key += std::to_string(pos.col - anchor.col);
+    }
+
+    [[noreturn]] void ThrowLexingError(size_t offset) const
+    {
+        throw ParsingError("Error when lexing: token recognition error at: '" + std::string(1, text_[offset]) + "'");
+    }
+
+    // Reads the longest token starting at the current offset, like the ANTLR lexer does
+    void NextToken()
+    {
+        while (offset_ < text_.size() && IsSpace(text_[offset_]))
+        {
+            ++offset_;
+        }
+        if (offset_ == text_.size())
+        {
+            token_ = Token::End;
+            token_text_ = "<EOF>";
+            return;
+        }
+
+        const size_t start = offset_;
+        const char ch = text_[offset_];
+        switch (ch)
+        {
+        case '+':
+            token_ = Token::Add;
+            ++offset_;
+            break;
+        case '-':
+            token_ = Token::Sub;
+            ++offset_;
+            break;
+        case '*':
+            token_ = Token::Mul;
+            ++offset_;
+            break;
+        case '/':
+            token_ = Token::Div;
+            ++offset_;
+            break;
+        case '(':
+            token_ = Token::LeftParen;
+            ++offset_;
+            break;
+        case ')':
+            token_ = Token::RightParen;
+            ++offset_;
+            break;
+        case ',':
+            token_ = Token::Comma;
+            ++offset_;
+            break;
+        default:
+            if (IsDigit(ch) || ch == '.')
+            {
+                // NUMBER: UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+                size_t end = SkipDigits(offset_);
+                if (end < text_.size() && text_[end] == '.' && SkipDigits(end + 1) > end + 1)
+                {
+                    end = SkipDigits(end + 1);
+                }
+                else if (end == offset_)
+                {
+                    ThrowLexingError(offset_);
+                }
+                offset_ = SkipExponent(end);
+                token_ = Token::Number;
+            }
+            else if (IsLetter(ch))
+            {
+                size_t end = SkipCell(offset_);
+                if (end == offset_)
+                {
+                    // NAME: [A-Z]+
+                    offset_ = SkipLetters(offset_);
+                    token_ = Token::Name;
+                }
+                else if (end < text_.size() && text_[end] == ':' && SkipCell(end + 1) > end + 1)
+                {
+                    offset_ = SkipCell(end + 1);
+                    token_ = Token::Range;
+                }
+                else
+                {
+                    offset_ = end;
+                    token_ = Token::Cell;
+                }
+            }
+            else
+            {
+                ThrowLexingError(offset_);
+            }
+        }
+        token_text_ = text_.substr(start, offset_ - start);
+    }
+
+    // expr (ADD | SUB) expr, left associative
+    uint32_t ParseAdditive()
+    {
+        auto lhs = ParseMultiplicative();
+        while (token_ == Token::Add || token_ == Token::Sub)
+        {
+            auto type = token_ == Token::Add ? NodeType::Add : NodeType::Subtract;
+            NextToken();
+            auto rhs = ParseMultiplicative();
+            lhs = builder_.AddBinary(type, lhs, rhs);
+        }
+        return lhs;
+    }
+
+    // expr (MUL | DIV) expr, left associative
+    uint32_t ParseMultiplicative()
+    {
+        auto lhs = ParseUnary();
+        while (token_ == Token::Mul || token_ == Token::Div)
+        {
+            auto type = token_ == Token::Mul ? NodeType::Multiply : NodeType::Divide;
+            NextToken();
+            auto rhs = ParseUnary();
+            lhs = builder_.AddBinary(type, lhs, rhs);
+        }
+        return lhs;
+    }
+
+    // (ADD | SUB) expr, binds tighter than binary operations
+    uint32_t ParseUnary()
+    {
+        if (token_ != Token::Add && token_ != Token::Sub)
+        {
+            return ParsePrimary();
+        }
+        auto type = token_ == Token::Add ? NodeType::UnaryPlus : NodeType::UnaryMinus;
+        NextToken();
+        auto operand = ParseUnary();
+        return builder_.AddUnary(type, operand);
+    }
+
+    // '(' expr ')' | CELL | NUMBER
+    uint32_t ParsePrimary()
+    {
+        uint32_t node;
+        switch (token_)
+        {
+        case Token::LeftParen:
+            NextToken();
+            node = ParseAdditive();
+            if (token_ != Token::RightParen)
+            {
+                throw ParsingError("Error when parsing: " + std::string(token_text_));
+            }
+            break;
+        case Token::Number:
+            node = builder_.AddNumber(ParseNumber(token_text_));
+            break;
+        case Token::Cell: {
+            auto value = Position::FromString(token_text_);
+            if (!value.IsValid())
+            {
+                throw FormulaException("Invalid position: " + std::string(token_text_));
+            }
+            node = builder_.AddCell(value);
+            break;
+        }
+        case Token::Name:
+            node = ParseFunction();
+            break;
+        default:
+            throw ParsingError("Error when parsing: " + std::string(token_text_));
+        }
+        NextToken();
+        return node;
+    }
+
+    // NAME '(' arg (',' arg)* ')', stops at the closing parenthesis
+    uint32_t ParseFunction()
+    {
+        auto function = FindFunction(token_text_);
+        if (!function)
+        {
+            throw ParsingError("Unknown function: " + std::string(token_text_));
+        }
+        NextToken();
+        if (token_ != Token::LeftParen)
+        {
+            throw ParsingError("Error when parsing: " + std::string(token_text_));
+        }
+        std::vector<uint32_t> args;
+        do
+        {
+            NextToken();
+            args.push_back(ParseArgument());
+        } while (token_ == Token::Comma);
+        if (token_ != Token::RightParen)
+        {
+            throw ParsingError("Error when parsing: " + std::string(token_text_));
+        }
+        return builder_.AddCall(*function, args);
+    }
+
+    // RANGE | expr
+    uint32_t ParseArgument()
+    {
+        if (token_ != Token::Range)
+        {
+            return ParseAdditive();
+        }
+        const size_t colon = token_text_.find(':');
+        auto first = Position::FromString(token_text_.substr(0, colon));
+        auto last = Position::FromString(token_text_.substr(colon + 1));
+        if (!first.IsValid() || !last.IsValid())
+        {
+            throw FormulaException("Invalid range: " + std::string(token_text_));
+        }
+        auto node = builder_.AddRange(Range::Between(first, last));
+        NextToken();
+        return node;
+    }
+
+    // Accepts the same values as reading the literal from a stream
+    static double ParseNumber(std::string_view text)
+    {
+        constexpr size_t BUFFER_SIZE = 64;
+        char buffer[BUFFER_SIZE];
+        std::string long_text;
+        const char *str = buffer;
+        if (text.size() < BUFFER_SIZE)
+        {
+            std::copy(text.begin(), text.end(), buffer);
+            buffer[text.size()] = '\0';
+        }
+        else
+        {
+            long_text = text;
+            str = long_text.c_str();
+        }
+
+        double value = std::strtod(str, nullptr);
+        if (value == HUGE_VAL)
+        {
+            throw ParsingError("Invalid number: " + std::string(text));
+        }
+        return value;
+    }
+};
+
 } // namespace
 } // namespace ASTImpl
 
+namespace
+{
+std::atomic<FormulaParserMode> default_parser_mode{FormulaParserMode::HandWritten};
+} // namespace
+
+void SetDefaultFormulaParserMode(FormulaParserMode mode)
+{
+    default_parser_mode = mode;
+}
+
+FormulaParserMode GetDefaultFormulaParserMode()
+{
+    return default_parser_mode;
+}
+
 FormulaAST ParseFormulaAST(std::istream &in)
 {
     using namespace antlr4;
@@ -487,15 +1367,26 @@ FormulaAST ParseFormulaAST(std::istream &in)
     ASTImpl::ParseASTListener listener;
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    auto [formula_tree, refs] = listener.Build();
+    return FormulaAST(std::move(formula_tree), std::move(refs));
 }
 
 FormulaAST ParseFormulaAST(const std::string &in_str)
 {
-    std::istringstream in(in_str);
+    return ParseFormulaAST(in_str, default_parser_mode);
+}
+
+FormulaAST ParseFormulaAST(std::string_view in_str, FormulaParserMode mode)
+{
     try
     {
-        return ParseFormulaAST(in);
+        if (mode == FormulaParserMode::Antlr)
+        {
+            std::istringstream in{std::string(in_str)};
+            return ParseFormulaAST(in);
+        }
+        auto [tree, refs] = ASTImpl::HandWrittenParser(in_str).Parse();
+        return FormulaAST(std::move(tree), std::move(refs));
     }
     catch (const std::exception &exc)
     {
@@ -503,9 +1394,21 @@ FormulaAST ParseFormulaAST(const std::string &in_str)
     }
 }
 
+std::optional<std::string> MakeRelativeFormulaKey(std::string_view text, Position anchor)
+{
+    try
+    {
+        return ASTImpl::HandWrittenParser(text).MakeRelativeKey(anchor);
+    }
+    catch (const ParsingError &)
+    {
+        return std::nullopt;
+    }
+}
+
 void FormulaAST::PrintCells(std::ostream &out) const
 {
-    for (auto cell : cells_)
+    for (auto cell : refs_.cells)
     {
         out << cell.ToString() << ' ';
     }
@@ -513,30 +1416,173 @@ void FormulaAST::PrintCells(std::ostream &out) const
 
 void FormulaAST::Print(std::ostream &out) const
 {
-    root_expr_->Print(out);
+    ASTImpl::PrintTree(out, tree_, refs_, tree_.GetRoot());
 }
 
 void FormulaAST::PrintFormula(std::ostream &out) const
 {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+    out << GetExpression(refs_);
+}
+
+std::string FormulaAST::GetExpression(const ASTImpl::References &refs) const
+{
+    std::string result;
+    result.reserve(text_template_.text.size() + text_template_.slots.size() * 8);
+    size_t copied = 0;
+    for (const auto &slot : text_template_.slots)
+    {
+        result.append(text_template_.text, copied, slot.offset - copied);
+        copied = slot.offset;
+        if (slot.range)
+        {
+            result += refs.ranges[slot.index].ToString();
+        }
+        else
+        {
+            result += refs.cells[slot.index].ToString();
+        }
+    }
+    result.append(text_template_.text, copied);
+    return result;
+}
+
+const ASTImpl::References &FormulaAST::GetReferences() const
+{
+    return refs_;
 }
 
-double FormulaAST::Execute(const SheetInterface &sheet) const
+const ASTImpl::Tree &FormulaAST::GetTree() const
 {
-    return root_expr_->Evaluate(sheet);
+    return tree_;
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-    : root_expr_(std::move(root_expr)), cells_(std::move(cells))
+const ASTImpl::Bytecode &FormulaAST::GetBytecode() const
 {
+    return bytecode_;
 }
 
-std::vector<Position> FormulaAST::GetReferencedCells() const
+EvaluationResult FormulaAST::Execute(const SheetInterface &sheet) const
 {
-    if (cells_.empty())
-        return {};
-    std::set<Position> cells_set{cells_.begin(), cells_.end()};
-    return {cells_set.begin(), cells_set.end()};
+    return Execute(sheet, refs_);
 }
 
+EvaluationResult FormulaAST::Execute(const SheetInterface &sheet, const ASTImpl::References &refs,
+                                     const CellInterface *const *cells) const
+{
+    assert(refs.cells.size() == refs_.cells.size() && refs.ranges.size() == refs_.ranges.size());
+    if (cells)
+        return Run(sheet, refs, [cells](uint32_t i) { return cells[i]; });
+    return Run(sheet, refs, [&sheet, &refs](uint32_t i) { return sheet.GetCell(refs.cells[i]); });
+}
+
+template <typename CellFinder>
+EvaluationResult FormulaAST::Run(const SheetInterface &sheet, const ASTImpl::References &refs,
+                                 CellFinder find_cell) const
+{
+    using ASTImpl::OpCode;
+
+    constexpr size_t INLINE_STACK_SIZE = 64;
+    double inline_stack[INLINE_STACK_SIZE];
+    std::unique_ptr<double[]> heap_stack;
+    double *stack = inline_stack;
+    if (bytecode_.stack_depth > INLINE_STACK_SIZE)
+    {
+        heap_stack = std::make_unique<double[]>(bytecode_.stack_depth);
+        stack = heap_stack.get();
+    }
+
+    // the first error is the result of the whole formula, the stack holds numbers only
+    const FormulaError div0{FormulaError::Category::Div0};
+    double *top = stack; // points past the topmost value
+    for (const auto &instruction : bytecode_.code)
+    {
+        switch (instruction.code)
+        {
+        case OpCode::PushNumber:
+            *top++ = bytecode_.constants[instruction.operand];
+            break;
+        case OpCode::PushCell: {
+            // same as ReadCellValue(), an empty cell reads as zero
+            if (!refs.cells[instruction.operand].IsValid())
+                return FormulaError(FormulaError::Category::Ref);
+            const CellInterface *cell = find_cell(instruction.operand);
+            std::optional<NumericValue> value = cell ? cell->GetNumericValue() : std::nullopt;
+            if (value && ASTImpl::IsError(*value))
+                return *value;
+            *top++ = value ? std::get<double>(*value) : 0.0;
+            break;
+        }
+        case OpCode::Add:
+            --top;
+            top[-1] += *top;
+            if (!std::isfinite(top[-1]))
+                return div0;
+            break;
+        case OpCode::Subtract:
+            --top;
+            top[-1] -= *top;
+            if (!std::isfinite(top[-1]))
+                return div0;
+            break;
+        case OpCode::Multiply:
+            --top;
+            top[-1] *= *top;
+            if (!std::isfinite(top[-1]))
+                return div0;
+            break;
+        case OpCode::Divide:
+            --top;
+            top[-1] /= *top;
+            if (!std::isfinite(top[-1]))
+                return div0;
+            break;
+        case OpCode::Negate:
+            top[-1] = -top[-1];
+            break;
+        case OpCode::Call: {
+            const auto &call = bytecode_.calls[instruction.operand];
+            top -= call.scalar_count;
+            ASTImpl::Aggregator aggregator(call.function);
+            for (uint32_t i = 0; i < call.scalar_count; ++i)
+                aggregator.Add(top[i]);
+            for (uint32_t range : call.ranges)
+                aggregator.AddRange(sheet, refs.ranges[range]);
+            auto result = aggregator.Result();
+            if (ASTImpl::IsError(result))
+                return result;
+            *top++ = std::get<double>(result);
+            break;
+        }
+        }
+    }
+    assert(top == stack + 1);
+    return *stack;
+}
+
+EvaluationResult FormulaAST::ExecuteTree(const SheetInterface &sheet) const
+{
+    return ASTImpl::TreeWalker(tree_, sheet, refs_).Evaluate(tree_.GetRoot());
+}
+
+FormulaAST::FormulaAST(ASTImpl::Tree tree, ASTImpl::References refs)
+    : tree_(std::move(tree)), refs_(std::move(refs)), bytecode_(ASTImpl::Compiler(tree_).Compile())
+{
+    ASTImpl::TemplateWriter writer(text_template_);
+    ASTImpl::PrintFormula(writer, tree_, tree_.GetRoot(), ASTImpl::EP_ATOM);
+}
+
+const std::vector<Position> &FormulaAST::GetReferencedCells() const
+{
+    return refs_.cells;
+}
+
+const std::vector<Range> &FormulaAST::GetReferencedRanges() const
+{
+    return refs_.ranges;
+}
+
+FormulaAST::FormulaAST(FormulaAST &&) = default;
+
+FormulaAST &FormulaAST::operator=(FormulaAST &&) = default;
+
 FormulaAST::~FormulaAST() = default;
\ No newline at end of file
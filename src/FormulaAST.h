@@ -1,16 +1,129 @@
 #pragma once
 
-#include "../antlr/Formula/FormulaLexer.h"
 #include "common.h"
 
-#include <forward_list>
+#include <cstdint>
 #include <functional>
+#include <iosfwd>
+#include <memory>
+#include <optional>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
 
 namespace ASTImpl
 {
-class Expr;
-}
+enum class OpCode : uint8_t
+{
+    PushNumber, // pushes constants[operand]
+    PushCell,   // pushes value of cells[operand]
+    Add,
+    Subtract,
+    Multiply,
+    Divide,
+    Negate,
+    Call, // replaces calls[operand].scalar_count values with the result of the call
+};
+
+enum class Function : uint8_t
+{
+    Sum,
+    Average,
+    Min,
+    Max,
+    Count,
+};
+
+struct Instruction
+{
+    OpCode code;
+    uint32_t operand;
+};
+
+// Call of an aggregate function: scalar arguments are taken from the stack
+struct FunctionCall
+{
+    Function function;
+    uint32_t scalar_count = 0;
+    std::vector<uint32_t> ranges; // indices in References::ranges
+};
+
+// Expression lowered into postfix order for a stack machine, with constant subexpressions folded.
+// Cells and ranges are referred to by indices in References
+struct Bytecode
+{
+    std::vector<Instruction> code;
+    std::vector<double> constants;
+    std::vector<FunctionCall> calls;
+    size_t stack_depth = 0;
+};
+
+enum class NodeType : uint8_t
+{
+    Number,     // first: index in Tree::numbers
+    Cell,       // first: index in References::cells
+    Range,      // first: index in References::ranges, only an argument of a call
+    UnaryPlus,  // first: operand
+    UnaryMinus, // first: operand
+    Add,        // first, second: operands
+    Subtract,
+    Multiply,
+    Divide,
+    Call, // first: index of the first argument in Tree::arguments, second: number of arguments
+};
+
+struct Node
+{
+    NodeType type;
+    Function function; // of a call
+    uint32_t first = 0;
+    uint32_t second = 0;
+};
+
+// Expression tree in flat arrays, at most three allocations whatever its size. Nodes are linked
+// by indices and stored in postfix order: the nodes of a subtree are contiguous and end with
+// its root, operands in their order, so the root of the tree is the last node
+struct Tree
+{
+    std::vector<Node> nodes;
+    std::vector<double> numbers;
+    std::vector<uint32_t> arguments; // nodes of call arguments
+
+    uint32_t GetRoot() const
+    {
+        return static_cast<uint32_t>(nodes.size() - 1);
+    }
+};
+
+// Cells and ranges referenced by a formula, sorted and without duplicates.
+// Nodes of the tree and the bytecode refer to them by index
+struct References
+{
+    std::vector<Position> cells;
+    std::vector<Range> ranges;
+};
+
+// Canonical text of a formula with its references cut out, printed once by the tree, so that
+// the text of any formula of the same shape is produced without walking the tree
+struct TextTemplate
+{
+    struct Slot
+    {
+        uint32_t offset; // in text
+        uint32_t index;  // in References::cells or References::ranges
+        bool range;
+    };
+
+    std::string text;
+    std::vector<Slot> slots; // ordered by offset
+};
+} // namespace ASTImpl
+
+// Number or error produced by evaluation. Errors are returned as values instead of
+// being thrown, so cells depending on errors are evaluated as fast as numbers
+using EvaluationResult = std::variant<double, FormulaError>;
 
 class ParsingError : public std::runtime_error
 {
@@ -20,15 +133,26 @@ class ParsingError : public std::runtime_error
 class FormulaAST
 {
   public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells);
+    FormulaAST(ASTImpl::Tree tree, ASTImpl::References refs);
 
-    FormulaAST(FormulaAST &&) = default;
+    FormulaAST(FormulaAST &&);
 
-    FormulaAST &operator=(FormulaAST &&) = default;
+    FormulaAST &operator=(FormulaAST &&);
 
     ~FormulaAST();
 
-    double Execute(const SheetInterface &sheet) const;
+    // Evaluates compiled bytecode
+    EvaluationResult Execute(const SheetInterface &sheet) const;
+
+    // Evaluates with references of another formula of the same shape,
+    // refs must have the same sizes as GetReferences().
+    // Unless cells is null, cells[i] is the cell at refs.cells[i] already found in the sheet
+    // (null if there is none), referenced cells are then read without lookups
+    EvaluationResult Execute(const SheetInterface &sheet, const ASTImpl::References &refs,
+                             const CellInterface *const *cells = nullptr) const;
+
+    // Evaluates by walking the tree, kept as a reference for the bytecode
+    EvaluationResult ExecuteTree(const SheetInterface &sheet) const;
 
     void PrintCells(std::ostream &out) const;
 
@@ -36,17 +160,60 @@ class FormulaAST
 
     void PrintFormula(std::ostream &out) const;
 
-    std::vector<Position> GetReferencedCells() const;
+    // Canonical text of the formula with references of another formula of the same shape
+    std::string GetExpression(const ASTImpl::References &refs) const;
+
+    const ASTImpl::References &GetReferences() const;
+
+    const ASTImpl::Tree &GetTree() const;
+
+    const ASTImpl::Bytecode &GetBytecode() const;
+
+    // Sorted and without duplicates, computed once by the parser
+    const std::vector<Position> &GetReferencedCells() const;
+
+    // Ranges used as arguments of functions, sorted and without duplicates.
+    // Cells of a range are not included into GetReferencedCells()
+    const std::vector<Range> &GetReferencedRanges() const;
 
   private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
+    ASTImpl::Tree tree_;
 
-    // physically stores cells so that they can be
+    // physically stores references so that they can be
     // efficiently traversed without going through
     // the whole AST
-    std::forward_list<Position> cells_;
+    ASTImpl::References refs_;
+
+    ASTImpl::Bytecode bytecode_;
+
+    ASTImpl::TextTemplate text_template_;
+
+    // Runs the bytecode, find_cell(i) returns the cell at the valid position refs.cells[i] or null
+    template <typename CellFinder>
+    EvaluationResult Run(const SheetInterface &sheet, const ASTImpl::References &refs, CellFinder find_cell) const;
 };
 
+enum class FormulaParserMode
+{
+    HandWritten, // recursive-descent parser, used by default
+    Antlr,       // parser generated from antlr/Formula.g4, kept as the reference
+};
+
+// Selects the parser used by ParseFormulaAST(const std::string &)
+void SetDefaultFormulaParserMode(FormulaParserMode mode);
+
+FormulaParserMode GetDefaultFormulaParserMode();
+
+// Parses with ANTLR, errors are reported with the ANTLR exceptions
 FormulaAST ParseFormulaAST(std::istream &in);
 
-FormulaAST ParseFormulaAST(const std::string &in_str);
\ No newline at end of file
+// Throws FormulaException if the formula is incorrect
+FormulaAST ParseFormulaAST(const std::string &in_str);
+
+FormulaAST ParseFormulaAST(std::string_view in_str, FormulaParserMode mode);
+
+// Tokens of the formula separated by spaces, with cell references written relative to anchor
+// in R1C1 style: "B2*C2" in B3 gives "R-1C0 * R-1C1". Formulas with equal keys differ only by a
+// shift of references. Invalid references are kept as they are. Returns nullopt if the text
+// can not be tokenized
+std::optional<std::string> MakeRelativeFormulaKey(std::string_view text, Position anchor);
\ No newline at end of file
@@ -1,240 +1,1043 @@
 #include "cell.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <limits>
+#include <mutex>
 #include <string>
 #include <utility>
 
-Graph::Graph(SheetInterface &sheet) : sheet_(sheet)
+Graph::Graph(SheetInterface &sheet, TiledTable<Cell> &cells) : sheet_(sheet), cells_(cells)
 {
 }
 
-bool Graph::UpdateCell(Position pos, const std::vector<Position> &new_referenced_cells)
+template <typename Func> void Graph::ForEachDependant(Position pos, Func func) const
 {
+    if (const CellsStorage *dependants = dependants_.Find(pos))
+    {
+        for (const auto &cell : *dependants)
+            func(cell);
+    }
+    ForEachRangeDependant(pos, func);
+}
 
-    CellsStorage old_referenced_cells = referenced_cells_[pos];
-    referenced_cells_[pos] = CellsStorage{new_referenced_cells.begin(), new_referenced_cells.end()};
+template <typename Func> void Graph::ForEachRangeDependant(Position pos, Func func) const
+{
+    const RangeDependants *ranges =
+        range_dependants_.Find({pos.row >> RANGE_TILE_SHIFT, pos.col >> RANGE_TILE_SHIFT});
+    if (!ranges)
+        return;
+    for (const auto &[range, dependant] : *ranges)
+    {
+        if (range.Contains(pos))
+            func(dependant);
+    }
+}
 
-    if (HasCircularDependency(pos))
+template <typename Func> void Graph::ForEachOrderedCell(Range range, Func func) const
+{
+    // scan whichever is smaller: the range or the ordered cells
+    if (range.CellCount() <= order_.Size())
     {
-        referenced_cells_[pos] = old_referenced_cells;
-        return false;
+        for (int row = range.first.row; row <= range.last.row; ++row)
+        {
+            for (int col = range.first.col; col <= range.last.col; ++col)
+            {
+                if (const int *order = order_.Find({row, col}))
+                    func(Position{row, col}, *order);
+            }
+        }
+        return;
     }
+    order_.ForEach([&range, &func](Position pos, int order) {
+        if (range.Contains(pos))
+            func(pos, order);
+    });
+}
 
-    for (const auto &cell : old_referenced_cells)
-        dependants_[cell].erase(pos);
-    for (const auto &cell : new_referenced_cells)
-        dependants_[cell].insert(pos);
+template <typename Func> void Graph::ForEachRangeTile(Range range, Func func)
+{
+    for (int row = range.first.row >> RANGE_TILE_SHIFT; row <= range.last.row >> RANGE_TILE_SHIFT; ++row)
+    {
+        for (int col = range.first.col >> RANGE_TILE_SHIFT; col <= range.last.col >> RANGE_TILE_SHIFT; ++col)
+            func(Position{row, col});
+    }
+}
 
+bool Graph::UpdateCell(Position pos, const std::vector<Position> &new_referenced_cells,
+                       const std::vector<Range> &new_referenced_ranges)
+{
+    // removing dependencies never breaks the topological order
+    auto [old_referenced_cells, old_referenced_ranges] = TakeDependencies(pos);
+    if (!AddEdges(pos, new_referenced_cells, new_referenced_ranges))
+    {
+        // the old dependencies were acyclic, they are restored without failures
+        AddEdges(pos, {old_referenced_cells.begin(), old_referenced_cells.end()}, old_referenced_ranges);
+        return false;
+    }
+
+    dirty_.Insert(pos);
     PurgeCache(pos);
     return true;
 }
 
-bool Graph::HasCircularDependency(Position pos) const
+std::vector<Position> Graph::UpdateCells(const std::vector<CellDependencies> &cells)
 {
-    bool is_cyclic_graph{false};
-    VertexTagger tags{};
-    CircularDepsDFS(pos, tags, is_cyclic_graph);
-    return is_cyclic_graph;
+    // old dependencies are kept for a rollback
+    std::vector<std::pair<CellsStorage, RangesStorage>> old_dependencies;
+    old_dependencies.reserve(cells.size());
+    for (const auto &cell : cells)
+        old_dependencies.push_back(TakeDependencies(cell.pos));
+
+    // New edges are stored without reordering, self references are the only cycles seen here.
+    // If every edge agrees with the order there is no cycle, otherwise a cycle passes through
+    // the dependant cell of a misplaced edge. Cells getting an order have no edges yet,
+    // a rollback removes them from the order again
+    std::vector<Position> cyclic, ordered, misplaced;
+    for (const auto &cell : cells)
+    {
+        if (cell.cells.empty() && cell.ranges.empty())
+            continue;
+        if (auto [order, created] = order_.TryEmplace(cell.pos); created)
+        {
+            *order = ++max_order_;
+            ordered.push_back(cell.pos);
+        }
+        const int to_order = *order_.Find(cell.pos);
+        bool is_misplaced{false};
+        for (const auto &from : cell.cells)
+        {
+            if (from == cell.pos)
+            {
+                cyclic.push_back(cell.pos);
+                continue;
+            }
+            auto [from_order, created] = order_.TryEmplace(from);
+            if (created)
+            {
+                *from_order = --min_order_;
+                ordered.push_back(from);
+            }
+            is_misplaced |= *from_order > to_order;
+            referenced_cells_.Emplace(cell.pos).Insert(from);
+            dependants_.Emplace(from).Insert(cell.pos);
+        }
+        for (const auto &range : cell.ranges)
+        {
+            if (range.Contains(cell.pos))
+            {
+                cyclic.push_back(cell.pos);
+                continue;
+            }
+            ForEachOrderedCell(range,
+                               [to_order, &is_misplaced](Position, int order) { is_misplaced |= order > to_order; });
+            LinkRange(range, cell.pos);
+        }
+        if (is_misplaced)
+            misplaced.push_back(cell.pos);
+    }
+    // a cell placed after every other one may lie in ranges of formulas placed before it
+    for (const auto &pos : ordered)
+    {
+        const int order = *order_.Find(pos);
+        ForEachRangeDependant(pos, [this, order, &misplaced](Position dependant) {
+            if (*order_.Find(dependant) < order)
+                misplaced.push_back(dependant);
+        });
+    }
+
+    std::vector<Position> sorted;
+    std::vector<Position> sorting_cyclic = SortReachable(misplaced, sorted);
+    cyclic.insert(cyclic.end(), sorting_cyclic.begin(), sorting_cyclic.end());
+    if (cyclic.empty())
+    {
+        // nothing outside reaches back into the sorted cells, so they can follow every other cell
+        if (max_order_ > std::numeric_limits<int>::max() - static_cast<int>(sorted.size()))
+            CompactOrder();
+        for (auto it = sorted.rbegin(); it != sorted.rend(); ++it)
+            *order_.Find(*it) = ++max_order_;
+        for (const auto &cell : cells)
+        {
+            dirty_.Insert(cell.pos);
+            PurgeCache(cell.pos);
+        }
+        return cyclic;
+    }
+
+    for (size_t i = 0; i < cells.size(); ++i)
+    {
+        const Position pos = cells[i].pos;
+        TakeDependencies(pos);
+        auto &[old_cells, old_ranges] = old_dependencies[i];
+        for (const auto &referenced : old_cells)
+            dependants_.Emplace(referenced).Insert(pos);
+        for (const auto &range : old_ranges)
+            LinkRange(range, pos);
+        if (!old_cells.IsEmpty())
+            referenced_cells_.Emplace(pos) = std::move(old_cells);
+    }
+    for (const auto &pos : ordered)
+        order_.Erase(pos);
+    std::sort(cyclic.begin(), cyclic.end());
+    cyclic.erase(std::unique(cyclic.begin(), cyclic.end()), cyclic.end());
+    return cyclic;
 }
 
-void Graph::CircularDepsDFS(Position pos, VertexTagger &tags, bool &is_cyclic) const
+size_t Graph::Recalculate(ThreadPool *pool)
 {
-    enum
+    // cells of a level depend on dirty cells of the previous levels only and are evaluated in parallel
+    constexpr size_t CHUNK_SIZE = 64;
+    const std::vector<Position> cells(dirty_.begin(), dirty_.end());
+    FlatPositionMap<uint32_t> index;
+    index.Reserve(cells.size());
+    for (size_t i = 0; i < cells.size(); ++i)
+        index.Emplace(cells[i]) = static_cast<uint32_t>(i);
+
+    // number of dirty cells which have to be evaluated before the cell
+    auto pending = std::make_unique<std::atomic<int>[]>(cells.size());
+    for (const auto &cell : cells)
     {
-        VISITED,
-        FINISHED
-    };
-    if (!referenced_cells_.count(pos))
-    { // no referenced cells, this cell is finished
-        tags[pos] = FINISHED;
-        return;
+        ForEachDependant(cell, [&index, &pending](Position dependant) {
+            if (const uint32_t *i = index.Find(dependant))
+                pending[*i].fetch_add(1, std::memory_order_relaxed);
+        });
     }
-    tags[pos] = VISITED;
-    for (const auto &cell : referenced_cells_.at(pos))
+    std::vector<uint32_t> level;
+    for (size_t i = 0; i < cells.size(); ++i)
     {
-        if (tags.count(cell))
-        { // if cell tag exists
-            // if cell has VISITED status -> cycle found
-            if (tags[cell] == VISITED)
-                is_cyclic = true;
+        if (pending[i].load(std::memory_order_relaxed) == 0)
+            level.push_back(static_cast<uint32_t>(i));
+    }
+
+    size_t recalculated{0};
+    std::mutex next_mutex;
+    std::vector<uint32_t> next;
+    while (!level.empty())
+    {
+        ParallelFor(pool, level.size(), CHUNK_SIZE, [&](size_t begin, size_t end) {
+            std::vector<uint32_t> ready;
+            size_t evaluated{0};
+            for (size_t k = begin; k < end; ++k)
+            {
+                const Position pos = cells[level[k]];
+                const Cell *cell = FindCell(pos);
+                if (cell && !cell->IsCached())
+                { // all referenced cells are already evaluated, no recursion here
+                    cell->Evaluate();
+                    ++evaluated;
+                }
+                ForEachDependant(pos, [&index, &pending, &ready](Position dependant) {
+                    const uint32_t *i = index.Find(dependant);
+                    if (i && pending[*i].fetch_sub(1, std::memory_order_acq_rel) == 1)
+                        ready.push_back(*i);
+                });
+            }
+            std::lock_guard lock(next_mutex);
+            next.insert(next.end(), ready.begin(), ready.end());
+            recalculated += evaluated;
+        });
+        level.swap(next);
+        next.clear();
+    }
+
+    dirty_ = CellsStorage{};
+    return recalculated;
+}
+
+size_t Graph::DirtyCount() const
+{
+    return dirty_.Size();
+}
+
+FlatMapStats Graph::GetStats() const
+{
+    FlatMapStats stats = referenced_cells_.GetStats();
+    stats += dependants_.GetStats();
+    stats += order_.GetStats();
+    stats += referenced_ranges_.GetStats();
+    stats += range_dependants_.GetStats();
+    auto add_cells_stats = [&stats](Position, const CellsStorage &cells) { stats += cells.GetStats(); };
+    referenced_cells_.ForEach(add_cells_stats);
+    dependants_.ForEach(add_cells_stats);
+    return stats;
+}
+
+bool Graph::AddEdges(Position pos, const std::vector<Position> &cells, const std::vector<Range> &ranges)
+{
+    for (size_t i = 0; i < cells.size(); ++i)
+    {
+        if (!AddEdge(cells[i], pos))
+        {
+            for (size_t k = 0; k < i; ++k)
+                RemoveEdge(cells[k], pos);
+            return false;
         }
-        else
+    }
+    for (size_t i = 0; i < ranges.size(); ++i)
+    {
+        if (!AddRangeEdge(ranges[i], pos))
         {
-            // cell tag does not exist, visit cell
-            CircularDepsDFS(cell, tags, is_cyclic);
+            for (size_t k = 0; k < i; ++k)
+                RemoveRangeEdge(ranges[k], pos);
+            for (const auto &cell : cells)
+                RemoveEdge(cell, pos);
+            return false;
         }
-        if (is_cyclic)
-            return;
     }
-    tags[pos] = FINISHED;
+    return true;
 }
 
-void Graph::PurgeCache(Position pos)
+bool Graph::AddEdge(Position from, Position to)
 {
-    VertexTagger visited;
-    PurgeCacheDFS(pos, visited);
+    if (from == to)
+        return false;
+
+    const int lower = EnsureOrder(to);
+    // a new referenced cell has no dependencies and can be placed before every other cell
+    auto [from_order, from_created] = order_.TryEmplace(from);
+    if (from_created)
+        *from_order = --min_order_;
+    const int upper = *from_order;
+
+    if (upper > lower && !Reorder(from, to, lower, upper))
+        return false;
+    referenced_cells_.Emplace(to).Insert(from);
+    dependants_.Emplace(from).Insert(to);
+    return true;
+}
+
+void Graph::RemoveEdge(Position from, Position to)
+{
+    Unlink(referenced_cells_, to, from);
+    Unlink(dependants_, from, to);
+}
+
+void Graph::Unlink(LinkedCellsStorage &links, Position key, Position cell)
+{
+    CellsStorage *cells = links.Find(key);
+    if (cells && cells->Erase(cell) && cells->IsEmpty())
+        links.Erase(key);
+}
+
+std::pair<Graph::CellsStorage, Graph::RangesStorage> Graph::TakeDependencies(Position pos)
+{
+    std::pair<CellsStorage, RangesStorage> result;
+    if (CellsStorage *cells = referenced_cells_.Find(pos))
+    {
+        result.first = std::move(*cells);
+        referenced_cells_.Erase(pos);
+    }
+    if (RangesStorage *ranges = referenced_ranges_.Find(pos))
+    {
+        result.second = std::move(*ranges);
+        referenced_ranges_.Erase(pos);
+    }
+    for (const auto &cell : result.first)
+        Unlink(dependants_, cell, pos);
+    for (const auto &range : result.second)
+        UnregisterRange(range, pos);
+    return result;
+}
+
+bool Graph::AddRangeEdge(Range range, Position to)
+{
+    if (range.Contains(to))
+        return false;
+
+    // cells of the range placed after `to` have to be moved before it, unless `to` reaches them
+    std::vector<Position> misplaced;
+    const int to_order = EnsureOrder(to);
+    ForEachOrderedCell(range, [to_order, &misplaced](Position cell, int order) {
+        if (order > to_order)
+            misplaced.push_back(cell);
+    });
+    for (const auto &cell : misplaced)
+    {
+        const int lower = *order_.Find(to), upper = *order_.Find(cell);
+        if (upper > lower && !Reorder(cell, to, lower, upper))
+            return false;
+    }
+
+    LinkRange(range, to);
+    return true;
+}
+
+void Graph::LinkRange(Range range, Position to)
+{
+    referenced_ranges_.Emplace(to).push_back(range);
+    ForEachRangeTile(range,
+                     [this, range, to](Position tile) { range_dependants_.Emplace(tile).emplace_back(range, to); });
+}
+
+void Graph::RemoveRangeEdge(Range range, Position to)
+{
+    auto &ranges = *referenced_ranges_.Find(to);
+    ranges.erase(std::find(ranges.begin(), ranges.end(), range));
+    if (ranges.empty())
+        referenced_ranges_.Erase(to);
+    UnregisterRange(range, to);
+}
+
+void Graph::UnregisterRange(Range range, Position to)
+{
+    ForEachRangeTile(range, [this, range, to](Position tile) {
+        auto &dependants = range_dependants_.Emplace(tile);
+        dependants.erase(std::find(dependants.begin(), dependants.end(), std::pair{range, to}));
+        if (dependants.empty())
+            range_dependants_.Erase(tile);
+    });
 }
 
-void Graph::PurgeCacheDFS(Position pos, VertexTagger &visited)
+int Graph::EnsureOrder(Position pos)
 {
-    visited[pos];
-    if (!dependants_.count(pos))
-        return; // means nothing depends on this pos
-    for (const auto &cell : dependants_.at(pos))
+    auto [order, created] = order_.TryEmplace(pos);
+    if (!created)
+        return *order;
+    *order = ++max_order_;
+    // nothing can reach a new cell, so moving it before the formulas never fails
+    ForEachRangeDependant(pos, [this, pos](Position dependant) {
+        const int lower = *order_.Find(dependant), upper = *order_.Find(pos);
+        if (upper > lower)
+            Reorder(pos, dependant, lower, upper);
+    });
+    return *order_.Find(pos);
+}
+
+bool Graph::Reorder(Position from, Position to, int lower, int upper)
+{
+    // cells reachable from `to` which are placed before `from`
+    std::vector<Position> forward, stack{to};
+    CellsStorage visited;
+    visited.Insert(to);
+    bool is_cyclic{false};
+    while (!stack.empty() && !is_cyclic)
+    {
+        Position pos = stack.back();
+        stack.pop_back();
+        forward.push_back(pos);
+        ForEachDependant(pos, [&](Position cell) {
+            if (cell == from)
+                is_cyclic = true;
+            else if (*order_.Find(cell) < upper && visited.Insert(cell))
+                stack.push_back(cell);
+        });
+    }
+    if (is_cyclic)
+        return false;
+
+    // cells reaching `from` which are placed after `to`
+    std::vector<Position> backward;
+    stack.push_back(from);
+    visited.Insert(from);
+    auto visit_referenced = [&](Position cell, int order) {
+        if (order > lower && visited.Insert(cell))
+            stack.push_back(cell);
+    };
+    while (!stack.empty())
     {
-        if (!visited.count(cell))
+        Position pos = stack.back();
+        stack.pop_back();
+        backward.push_back(pos);
+        if (const CellsStorage *referenced_cells = referenced_cells_.Find(pos))
         {
-            static_cast<Cell *>(sheet_.GetCell(cell))->PurgeCache();
-            PurgeCacheDFS(cell, visited);
+            for (const auto &cell : *referenced_cells)
+                visit_referenced(cell, *order_.Find(cell));
+        }
+        if (const RangesStorage *ranges = referenced_ranges_.Find(pos))
+        {
+            for (const auto &range : *ranges)
+                ForEachOrderedCell(range, visit_referenced);
         }
     }
+
+    // both groups keep their relative order, the backward group takes the first of their slots
+    auto by_order = [this](Position lhs, Position rhs) { return *order_.Find(lhs) < *order_.Find(rhs); };
+    std::sort(forward.begin(), forward.end(), by_order);
+    std::sort(backward.begin(), backward.end(), by_order);
+    std::vector<int> slots;
+    slots.reserve(forward.size() + backward.size());
+    for (const auto &cell : backward)
+        slots.push_back(*order_.Find(cell));
+    for (const auto &cell : forward)
+        slots.push_back(*order_.Find(cell));
+    std::sort(slots.begin(), slots.end());
+
+    auto slot = slots.begin();
+    for (const auto &cell : backward)
+        *order_.Find(cell) = *slot++;
+    for (const auto &cell : forward)
+        *order_.Find(cell) = *slot++;
+    return true;
 }
 
-Impl::Value EmptyImpl::GetValue() const
+std::vector<Position> Graph::SortReachable(const std::vector<Position> &cells, std::vector<Position> &sorted) const
 {
-    return std::string{};
+    // iterative Tarjan's algorithm, a component comes out after every component it reaches
+    struct Visit
+    {
+        int index{0};
+        int low{0};
+        bool on_stack{false};
+    };
+    struct Frame
+    {
+        Position pos;
+        size_t begin; // dependants of the cell are edges[begin, end)
+        size_t next;
+        size_t end;
+    };
+    FlatPositionMap<Visit> visits;
+    std::vector<Frame> frames;
+    std::vector<Position> edges, components, cyclic;
+    int next_index{0};
+
+    auto open = [&](Position pos) {
+        visits.Emplace(pos) = {next_index, next_index, true};
+        ++next_index;
+        components.push_back(pos);
+        const size_t begin = edges.size();
+        ForEachDependant(pos, [&edges](Position dependant) { edges.push_back(dependant); });
+        frames.push_back({pos, begin, begin, edges.size()});
+    };
+
+    for (const auto &cell : cells)
+    {
+        if (visits.Contains(cell))
+            continue;
+        open(cell);
+        while (!frames.empty())
+        {
+            Frame &frame = frames.back();
+            if (frame.next != frame.end)
+            {
+                const Position next = edges[frame.next++];
+                const Visit *visit = visits.Find(next);
+                if (!visit)
+                {
+                    open(next);
+                }
+                else if (visit->on_stack)
+                {
+                    const int index = visit->index;
+                    Visit &current = *visits.Find(frame.pos);
+                    current.low = std::min(current.low, index);
+                }
+                continue;
+            }
+
+            const Position pos = frame.pos;
+            edges.resize(frame.begin);
+            frames.pop_back();
+            const Visit visit = *visits.Find(pos);
+            if (!frames.empty())
+            {
+                Visit &parent = *visits.Find(frames.back().pos);
+                parent.low = std::min(parent.low, visit.low);
+            }
+            if (visit.low != visit.index)
+                continue;
+
+            // pos is the root of a strongly connected component on top of the stack
+            size_t first = components.size() - 1;
+            while (!(components[first] == pos))
+                --first;
+            const bool is_cycle = components.size() - first > 1;
+            for (size_t i = first; i < components.size(); ++i)
+            {
+                visits.Find(components[i])->on_stack = false;
+                sorted.push_back(components[i]);
+                if (is_cycle)
+                    cyclic.push_back(components[i]);
+            }
+            components.resize(first);
+        }
+    }
+    return cyclic;
 }
 
-std::string EmptyImpl::GetText() const
+void Graph::CompactOrder()
 {
-    return {};
+    std::vector<std::pair<int, Position>> cells;
+    cells.reserve(order_.Size());
+    order_.ForEach([&cells](Position pos, int order) { cells.emplace_back(order, pos); });
+    std::sort(cells.begin(), cells.end());
+    min_order_ = 0;
+    max_order_ = 0;
+    for (const auto &[order, pos] : cells)
+        *order_.Find(pos) = ++max_order_;
 }
 
-std::vector<Position> EmptyImpl::GetReferencedCells() const
+void Graph::PurgeCache(Position pos)
 {
-    return {};
+    std::vector<Position> stack{pos};
+    while (!stack.empty())
+    {
+        Position current = stack.back();
+        stack.pop_back();
+        ForEachDependant(current, [this, &stack](Position cell) {
+            const Cell *dependant = FindCell(cell);
+            // an invalidated cell has no valid dependants, they were invalidated with it,
+            // a missing cell is being set by a batch and has nothing cached
+            if (dependant && dependant->IsCached())
+            {
+                cells_.FindMutable(cell)->PurgeCache();
+                dirty_.Insert(cell);
+                stack.push_back(cell);
+            }
+        });
+    }
 }
 
-void EmptyImpl::PurgeCache()
+const Cell *Graph::FindCell(Position pos) const
 {
+    return static_cast<const Cell *>(std::as_const(sheet_).GetCell(pos));
 }
 
-TextImpl::TextImpl(std::string text) : text_(std::move(text))
+void Graph::ResolveReferences(Position pos)
 {
+    // second is true when referenced cells of the position are already pushed
+    std::vector<std::pair<Position, bool>> stack;
+    PushUncachedReferences(pos, stack);
+    while (!stack.empty())
+    {
+        auto &[cell_pos, expanded] = stack.back();
+        const Cell *cell = FindCell(cell_pos);
+        if (cell->IsCached())
+        { // pushed more than once and evaluated already
+            stack.pop_back();
+        }
+        else if (expanded)
+        { // referenced cells are evaluated by now
+            stack.pop_back();
+            cell->Evaluate();
+        }
+        else
+        {
+            expanded = true;
+            PushUncachedReferences(cell_pos, stack);
+        }
+    }
 }
 
-Impl::Value TextImpl::GetValue() const
+void Graph::PushUncachedReferences(Position pos, std::vector<std::pair<Position, bool>> &stack) const
 {
-    if (!text_.empty() && text_.front() == '\'')
+    auto push_uncached = [this, &stack](Position cell) {
+        const Cell *referenced = FindCell(cell);
+        if (referenced && !referenced->IsCached())
+            stack.emplace_back(cell, false);
+    };
+    if (const CellsStorage *referenced_cells = referenced_cells_.Find(pos))
     {
-        return text_.substr(1);
+        for (const auto &cell : *referenced_cells)
+            push_uncached(cell);
+    }
+    // formulas without an order have no references and are evaluated without recursion
+    if (const RangesStorage *ranges = referenced_ranges_.Find(pos))
+    {
+        for (const auto &range : *ranges)
+            ForEachOrderedCell(range, [&push_uncached](Position cell, int) { push_uncached(cell); });
     }
-    return text_;
 }
 
-std::string TextImpl::GetText() const
+namespace
 {
-    return text_;
+const std::vector<Position> NO_CELLS;
+const std::vector<Range> NO_RANGES;
+
+// Numeric interpretation of a visible text value. Accepts the same texts as std::stod
+// with nothing left after the number, but does not throw
+std::optional<NumericValue> ParseNumber(const char *text)
+{
+    if (*text == '\0')
+        return std::nullopt;
+    char *end = nullptr;
+    errno = 0;
+    const double result = std::strtod(text, &end);
+    if (end == text || errno == ERANGE || *end != '\0')
+        return FormulaError(FormulaError::Category::Value);
+    return result;
 }
 
-std::vector<Position> TextImpl::GetReferencedCells() const
+// Text of a cell without the escape sign
+std::string_view GetVisibleText(std::string_view text)
 {
-    return {};
+    if (!text.empty() && text.front() == ESCAPE_SIGN)
+        text.remove_prefix(1);
+    return text;
 }
 
-void TextImpl::PurgeCache()
+template <typename Inline> Inline MakeInline(std::string_view text)
 {
+    Inline result{};
+    std::copy(text.begin(), text.end(), result.data.begin());
+    result.size = static_cast<uint8_t>(text.size());
+    return result;
 }
 
-FormulaImpl::FormulaImpl(std::string text, Position pos, SheetInterface *sheet)
-    : pos_(pos), formula_(ParseFormula(std::move(text))), sheet_(sheet)
+template <typename Inline> std::string_view GetInlineText(const Inline &text)
 {
-    assert(sheet);
+    return {text.data.data(), text.size};
 }
 
-Impl::Value FormulaImpl::GetValue() const
+template <typename... Funcs> struct Overloaded : Funcs...
+{
+    using Funcs::operator()...;
+};
+
+template <typename... Funcs> Overloaded(Funcs...) -> Overloaded<Funcs...>;
+
+// Sheet of the cells which are not stored in one, their formulas see no other cells
+class NoCells final : public SheetInterface
 {
-    if (cache_)
-        return *cache_;
-    auto value = formula_->Evaluate(*sheet_);
-    if (std::holds_alternative<double>(value))
+  public:
+    void SetCell(Position, std::string) override
     {
-        cache_ = std::optional(Value(std::get<double>(value)));
     }
-    else
+
+    const CellInterface *GetCell(Position) const override
+    {
+        return nullptr;
+    }
+
+    CellInterface *GetCell(Position) override
+    {
+        return nullptr;
+    }
+
+    void ClearCell(Position) override
+    {
+    }
+
+    Size GetPrintableSize() const override
+    {
+        return {0, 0};
+    }
+
+    void PrintValues(std::ostream &) const override
+    {
+    }
+
+    void PrintTexts(std::ostream &) const override
+    {
+    }
+};
+} // namespace
+
+static_assert(sizeof(void *) != 8 || sizeof(Cell) == 32, "a cell is a vtable pointer and 24 bytes of content");
+
+FormulaImpl::FormulaImpl(std::unique_ptr<FormulaInterface> formula, const CellContext &context)
+    : pos_(context.pos), formula_(std::move(formula)), text_(FORMULA_SIGN + formula_->GetExpression()),
+      sheet_(context.sheet), graph_(context.graph), table_(context.table)
+{
+    assert(sheet_);
+}
+
+FormulaImpl::FormulaImpl(const FormulaImpl &other)
+    : pos_(other.pos_), formula_(other.formula_), text_(other.text_), sheet_(other.sheet_), graph_(other.graph_),
+      table_(other.table_)
+{
+}
+
+FormulaInterface::Value FormulaImpl::Compute() const
+{
+    CacheState state = cache_state_.load(std::memory_order_acquire);
+    if (state == CacheState::Empty &&
+        cache_state_.compare_exchange_strong(state, CacheState::Filling, std::memory_order_acquire))
     {
-        cache_ = std::optional(Value(std::get<FormulaError>(value)));
+        FormulaInterface::Value value;
+        try
+        {
+            value = formula_->Evaluate(*sheet_, BindCells());
+        }
+        catch (...)
+        {
+            cache_state_.store(CacheState::Empty, std::memory_order_relaxed);
+            throw;
+        }
+        cache_ = value;
+        cache_state_.store(CacheState::Ready, std::memory_order_release);
+        return value;
+    }
+    if (state == CacheState::Ready)
+        return cache_;
+    // evaluation is pure: a reader losing the race computes the same value as the one stored,
+    // looking the referenced cells up since the bound ones belong to the reader filling the cache
+    return formula_->Evaluate(*sheet_);
+}
+
+const CellInterface *const *FormulaImpl::BindCells() const
+{
+    const auto &refs = formula_->GetReferencedCells();
+    if (!table_ || refs.empty())
+        return nullptr;
+    const uint64_t version = table_->GetLayoutVersion();
+    if (!bound_cells_ || bound_version_ != version)
+    {
+        if (!bound_cells_)
+            bound_cells_ = std::make_unique<const CellInterface *[]>(refs.size());
+        for (size_t i = 0; i < refs.size(); ++i)
+            bound_cells_[i] = refs[i].IsValid() ? table_->Find(refs[i]) : nullptr;
+        bound_version_ = version;
     }
-    return *cache_;
+    return bound_cells_.get();
+}
+
+FormulaInterface::Value FormulaImpl::GetValue() const
+{
+    if (graph_ && !IsCached())
+        graph_->ResolveReferences(pos_);
+    return Compute();
 }
 
-std::string FormulaImpl::GetText() const
+FormulaInterface::Value FormulaImpl::Evaluate() const
 {
-    return "=" + formula_->GetExpression();
+    return Compute();
 }
 
-std::vector<Position> FormulaImpl::GetReferencedCells() const
+std::string_view FormulaImpl::GetText() const
+{
+    return text_;
+}
+
+const std::vector<Position> &FormulaImpl::GetReferencedCells() const
 {
     return formula_->GetReferencedCells();
 }
 
+const std::vector<Range> &FormulaImpl::GetReferencedRanges() const
+{
+    return formula_->GetReferencedRanges();
+}
+
+bool FormulaImpl::IsCached() const
+{
+    return cache_state_.load(std::memory_order_acquire) == CacheState::Ready;
+}
+
 void FormulaImpl::PurgeCache()
 {
-    cache_.reset();
+    cache_state_.store(CacheState::Empty, std::memory_order_relaxed);
 }
 
-void Cell::Set(std::string text)
+CellContent::CellContent(std::string text, const CellContext &context)
 {
+    std::unique_ptr<FormulaInterface> formula;
+    if (Cell::IsFormulaText(text))
+    {
+        std::string expression = text.substr(1);
+        formula = context.cache ? context.cache->ParseFormula(std::move(expression), context.pos)
+                                : ParseFormula(std::move(expression));
+    }
+    *this = CellContent(std::move(text), std::move(formula), context);
+}
 
+CellContent::CellContent(std::string text, std::unique_ptr<FormulaInterface> formula, const CellContext &context)
+{
+    if (formula)
+    {
+        data_ = std::make_shared<FormulaImpl>(std::move(formula), context);
+        return;
+    }
     if (text.empty())
+        return;
+    const std::optional<NumericValue> number = ParseNumber(GetVisibleText(text).data());
+    const double *value = number ? std::get_if<double>(&*number) : nullptr;
+    if (value && text.size() <= INLINE_NUMBER_SIZE)
     {
-        impl_ = std::make_unique<EmptyImpl>();
+        auto &inline_number = data_.emplace<InlineNumber>(MakeInline<InlineNumber>(text));
+        inline_number.value = *value;
     }
-    else if (text.front() != FORMULA_SIGN || text.size() == 1)
-    { // '=' is not formula
-        impl_ = std::make_unique<TextImpl>(std::move(text));
+    else if (!value && text.size() <= INLINE_TEXT_SIZE)
+    {
+        data_ = MakeInline<InlineText>(text);
     }
     else
     {
-        auto tmp = std::make_unique<FormulaImpl>(text.substr(1), pos_, sheet_);
-        if (!graph_->UpdateCell(pos_, tmp->GetReferencedCells()))
-        {
-            throw CircularDependencyException("Circular dependency detected");
-        }
-        impl_ = std::move(tmp);
+        data_ = std::make_shared<const LongText>(LongText{std::move(text), number});
+    }
+}
+
+CellContent::Value CellContent::GetValue() const
+{
+    ValueView view = GetValueView();
+    if (const auto *text = std::get_if<std::string_view>(&view))
+        return std::string(*text);
+    if (const double *number = std::get_if<double>(&view))
+        return *number;
+    return std::get<FormulaError>(view);
+}
+
+CellContent::ValueView CellContent::GetValueView() const
+{
+    if (const auto *formula = std::get_if<std::shared_ptr<FormulaImpl>>(&data_))
+    {
+        const FormulaInterface::Value value = (*formula)->GetValue();
+        if (const double *number = std::get_if<double>(&value))
+            return *number;
+        return std::get<FormulaError>(value);
+    }
+    return GetVisibleText(GetText());
+}
+
+std::string_view CellContent::GetText() const
+{
+    return std::visit(Overloaded{
+                          [](std::monostate) { return std::string_view{}; },
+                          [](const InlineText &text) { return GetInlineText(text); },
+                          [](const InlineNumber &number) { return GetInlineText(number); },
+                          [](const std::shared_ptr<const LongText> &text) { return std::string_view(text->text); },
+                          [](const std::shared_ptr<FormulaImpl> &formula) { return formula->GetText(); },
+                      },
+                      data_);
+}
+
+const std::vector<Position> &CellContent::GetReferencedCells() const
+{
+    const FormulaImpl *formula = GetFormula();
+    return formula ? formula->GetReferencedCells() : NO_CELLS;
+}
+
+const std::vector<Range> &CellContent::GetReferencedRanges() const
+{
+    const FormulaImpl *formula = GetFormula();
+    return formula ? formula->GetReferencedRanges() : NO_RANGES;
+}
+
+std::optional<NumericValue> CellContent::GetNumericValue() const
+{
+    return std::visit(Overloaded{
+                          [](std::monostate) -> std::optional<NumericValue> { return std::nullopt; },
+                          [](const InlineText &text) -> std::optional<NumericValue> {
+                              if (GetVisibleText(GetInlineText(text)).empty())
+                                  return std::nullopt;
+                              return FormulaError(FormulaError::Category::Value);
+                          },
+                          [](const InlineNumber &number) -> std::optional<NumericValue> { return number.value; },
+                          [](const std::shared_ptr<const LongText> &text) { return text->number; },
+                          [](const std::shared_ptr<FormulaImpl> &formula) -> std::optional<NumericValue> {
+                              return formula->GetValue();
+                          },
+                      },
+                      data_);
+}
+
+bool CellContent::IsEmpty() const
+{
+    return std::holds_alternative<std::monostate>(data_);
+}
+
+bool CellContent::IsCached() const
+{
+    const FormulaImpl *formula = GetFormula();
+    return !formula || formula->IsCached();
+}
+
+void CellContent::Evaluate() const
+{
+    if (const FormulaImpl *formula = GetFormula())
+        formula->Evaluate();
+}
+
+void CellContent::PurgeCache()
+{
+    auto *formula = std::get_if<std::shared_ptr<FormulaImpl>>(&data_);
+    if (!formula)
+        return;
+    // other owners are copies of the content which never change it and may only release the formula:
+    // a count of one is final, the fence orders their last reads before the change
+    if (formula->use_count() > 1)
+    {
+        *formula = std::make_shared<FormulaImpl>(**formula);
+        return;
     }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    (*formula)->PurgeCache();
 }
 
-Cell &Cell::SetPosition(Position pos)
+const FormulaImpl *CellContent::GetFormula() const
 {
-    pos_ = pos;
-    return *this;
+    const auto *formula = std::get_if<std::shared_ptr<FormulaImpl>>(&data_);
+    return formula ? formula->get() : nullptr;
 }
 
-Cell &Cell::SetSheet(SheetInterface *sheet)
+void Cell::Set(std::string text)
+{
+    static NoCells no_cells;
+    content_ = CellContent(std::move(text), CellContext{Position::NONE, &no_cells});
+}
+
+void Cell::SetContent(CellContent content)
 {
-    sheet_ = sheet;
-    return *this;
+    content_ = std::move(content);
 }
 
-Cell &Cell::SetGraph(Graph *graph)
+bool Cell::IsFormulaText(std::string_view text)
 {
-    graph_ = graph;
-    return *this;
+    // '=' is not formula
+    return text.size() > 1 && text.front() == FORMULA_SIGN;
 }
 
 void Cell::PurgeCache()
 {
-    impl_->PurgeCache();
+    content_.PurgeCache();
 }
 
-void Cell::Clear()
+void Cell::Clear(const CellContext &context)
 {
-    graph_->UpdateCell(pos_, {});
-    impl_ = std::make_unique<EmptyImpl>();
+    if (context.graph)
+        context.graph->UpdateCell(context.pos, {});
+    content_ = CellContent();
 }
 
 Cell::Value Cell::GetValue() const
 {
-    return impl_->GetValue();
+    return content_.GetValue();
+}
+
+Cell::ValueView Cell::GetValueView() const
+{
+    return content_.GetValueView();
+}
+
+std::optional<NumericValue> Cell::GetNumericValue() const
+{
+    return content_.GetNumericValue();
 }
 
 std::string Cell::GetText() const
 {
-    return impl_->GetText();
+    return std::string(content_.GetText());
+}
+
+std::string_view Cell::GetTextView() const
+{
+    return content_.GetText();
+}
+
+const std::vector<Position> &Cell::GetReferencedCells() const
+{
+    return content_.GetReferencedCells();
+}
+
+const std::vector<Range> &Cell::GetReferencedRanges() const
+{
+    return content_.GetReferencedRanges();
+}
+
+bool Cell::IsEmpty() const
+{
+    return content_.IsEmpty();
+}
+
+bool Cell::IsCached() const
+{
+    return content_.IsCached();
 }
 
-std::vector<Position> Cell::GetReferencedCells() const
+void Cell::Evaluate() const
 {
-    return impl_->GetReferencedCells();
+    content_.Evaluate();
 }
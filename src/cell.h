@@ -1,127 +1,338 @@
 #pragma once
 
 #include "common.h"
+#include "flat_position_map.h"
 #include "formula.h"
+#include "thread_pool.h"
+#include "tiled_table.h"
+#include <array>
+#include <atomic>
+#include <cstdint>
 #include <optional>
+#include <utility>
+#include <variant>
+#include <vector>
 
-class Impl
+class Cell;
+class Graph;
+
+// Where a cell is stored. Cells do not keep it, the operations which need it get it from the sheet
+struct CellContext
+{
+    Position pos{Position::NONE};
+    SheetInterface *sheet{nullptr};
+    Graph *graph{nullptr};
+    FormulaCache *cache{nullptr}; // formulas of the same shape share one compiled body from the cache
+    const TiledTable<Cell> *table{nullptr}; // cells of the sheet, formulas bind their references to them
+};
+
+// Formula of a cell with its cached value. Keeps the context of the cell: evaluation
+// needs the sheet, and referenced cells are evaluated first through the graph.
+// Referenced cells are found in the table once and read through the pointers while
+// the layout of the table stays the same
+class FormulaImpl
 {
   public:
-    virtual ~Impl() = default;
+    FormulaImpl(std::unique_ptr<FormulaInterface> formula, const CellContext &context);
 
-    using Value = std::variant<std::string, double, FormulaError>;
+    // Copies everything but the cache
+    FormulaImpl(const FormulaImpl &other);
 
-    virtual Value GetValue() const = 0;
+    // Evaluates the uncached referenced cells first
+    FormulaInterface::Value GetValue() const;
 
-    virtual std::string GetText() const = 0;
+    // Same when the referenced cells are known to be evaluated, they are not checked through the graph
+    FormulaInterface::Value Evaluate() const;
 
-    virtual std::vector<Position> GetReferencedCells() const = 0;
+    std::string_view GetText() const;
 
-    virtual void PurgeCache() = 0;
-};
+    const std::vector<Position> &GetReferencedCells() const;
 
-class EmptyImpl : public Impl
-{
-  public:
-    Value GetValue() const override;
+    const std::vector<Range> &GetReferencedRanges() const;
 
-    std::string GetText() const override;
+    bool IsCached() const;
+
+    void PurgeCache();
 
-    std::vector<Position> GetReferencedCells() const override;
+  private:
+    enum class CacheState : uint8_t
+    {
+        Empty,
+        Filling, // the value is being computed and written to cache_ by one thread
+        Ready,
+    };
 
-    void PurgeCache() override;
+    Position pos_;
+    std::shared_ptr<const FormulaInterface> formula_; // shared by copies
+    std::string text_;                                // canonical text, printed once at parse time
+    SheetInterface *sheet_;
+    Graph *graph_;
+    const TiledTable<Cell> *table_;
+    // referenced cells found in table_ at its layout version bound_version_, used by the reader filling the cache
+    mutable std::unique_ptr<const CellInterface *[]> bound_cells_;
+    mutable uint64_t bound_version_{0};
+    // filled by the first reader which starts the evaluation, readers never wait for each other
+    mutable FormulaInterface::Value cache_{};
+    mutable std::atomic<CacheState> cache_state_{CacheState::Empty};
+
+    FormulaInterface::Value Compute() const;
+
+    // Referenced cells, looked up again if the layout of the table has changed. Null without a table or references
+    const CellInterface *const *BindCells() const;
 };
 
-class TextImpl : public Impl
+// Content of a cell in 24 bytes. Texts of up to 15 characters and numbers written with up to 7
+// are stored inline, longer texts and formulas are shared by copies of the content.
+// Views of an inline text point into the content, they are valid while it is neither changed nor moved
+class CellContent
 {
   public:
-    explicit TextImpl(std::string text);
+    using Value = CellInterface::Value;
+    using ValueView = CellInterface::ValueView;
 
-    Value GetValue() const override;
+    CellContent() = default;
 
-    std::string GetText() const override;
+    // Parses text of a cell, throws FormulaException
+    CellContent(std::string text, const CellContext &context);
 
-    std::vector<Position> GetReferencedCells() const override;
+    // Same for a text already parsed: formula is the expression of a formula text, null for other texts
+    CellContent(std::string text, std::unique_ptr<FormulaInterface> formula, const CellContext &context);
 
-    void PurgeCache() override;
+    Value GetValue() const;
 
-  private:
-    std::string text_;
-};
+    ValueView GetValueView() const;
 
-class FormulaImpl : public Impl
-{
-  public:
-    FormulaImpl(std::string text, Position pos, SheetInterface *sheet);
+    std::string_view GetText() const;
 
-    Value GetValue() const override;
+    const std::vector<Position> &GetReferencedCells() const;
 
-    std::string GetText() const override;
+    const std::vector<Range> &GetReferencedRanges() const;
+
+    std::optional<NumericValue> GetNumericValue() const;
+
+    bool IsEmpty() const;
 
-    std::vector<Position> GetReferencedCells() const override;
+    // False if the value of a formula has to be computed
+    bool IsCached() const;
 
-    void PurgeCache() override;
+    // Computes the value of a formula whose referenced cells are evaluated already
+    void Evaluate() const;
+
+    // A formula shared with copies of the content keeps its cached value for them, this content gets a copy
+    void PurgeCache();
 
   private:
-    Position pos_;
-    std::unique_ptr<FormulaInterface> formula_;
-    SheetInterface *sheet_;
-    mutable std::optional<Value> cache_{};
+    static constexpr size_t INLINE_TEXT_SIZE = 15;
+    static constexpr size_t INLINE_NUMBER_SIZE = 7;
+
+    // a text which is not a number, its numeric value is #VALUE! or nothing for a lone escape sign
+    struct InlineText
+    {
+        std::array<char, INLINE_TEXT_SIZE> data;
+        uint8_t size;
+    };
+
+    struct InlineNumber
+    {
+        double value;
+        std::array<char, INLINE_NUMBER_SIZE> data;
+        uint8_t size;
+    };
+
+    struct LongText
+    {
+        std::string text;
+        std::optional<NumericValue> number; // parsed once, the text never changes
+    };
+
+    std::variant<std::monostate, InlineText, InlineNumber, std::shared_ptr<const LongText>,
+                 std::shared_ptr<FormulaImpl>>
+        data_;
+
+    const FormulaImpl *GetFormula() const;
 };
 
+// Dependencies between cells.
+// Keeps a topological order of cells (referenced cells before their dependants) which is
+// updated incrementally with the Pearce-Kelly algorithm: a new dependency only touches cells
+// between the order positions of its ends, and only when the dependency contradicts the order.
+// A range is kept as a single dependency: formulas over ranges are found through an index of
+// ranges by the RANGE_TILE_SIZE x RANGE_TILE_SIZE tiles they overlap
 class Graph
 {
-    using CellsStorage = std::unordered_set<Position, Position::Hasher>;
-    using LinkedCellsStorage = std::unordered_map<Position, CellsStorage, Position::Hasher>;
-    using VertexTagger = std::unordered_map<Position, int, Position::Hasher>;
+    using CellsStorage = FlatPositionSet;
+    using LinkedCellsStorage = FlatPositionMap<CellsStorage>;
+    using VertexTagger = FlatPositionMap<int>;
+    using RangesStorage = std::vector<Range>;
+    using RangeDependants = std::vector<std::pair<Range, Position>>;
 
   public:
-    explicit Graph(SheetInterface &sheet);
+    static constexpr int RANGE_TILE_SHIFT = 6;
+
+    // New dependencies of a cell, see UpdateCells
+    struct CellDependencies
+    {
+        Position pos;
+        const std::vector<Position> &cells;
+        const std::vector<Range> &ranges;
+    };
+
+    // cells are the storage of the sheet, caches of formulas in it are purged through the graph
+    Graph(SheetInterface &sheet, TiledTable<Cell> &cells);
+
+    bool UpdateCell(Position pos, const std::vector<Position> &new_referenced_cells,
+                    const std::vector<Range> &new_referenced_ranges = {});
+
+    // Replaces dependencies of several distinct cells with one cycle check over the changed part
+    // of the graph. Returns the cells lying on cycles sorted by position, nothing is changed then.
+    // Changed cells may be missing from the sheet until their new content is set
+    std::vector<Position> UpdateCells(const std::vector<CellDependencies> &cells);
 
-    bool UpdateCell(Position pos, const std::vector<Position> &new_referenced_cells);
+    // Evaluates every dirty formula exactly once, in topological order of the dirty subgraph,
+    // returns the number of evaluated cells. Independent formulas are evaluated on the pool if there is one
+    size_t Recalculate(ThreadPool *pool = nullptr);
+
+    // Evaluates all uncached cells which pos depends on, deepest first, with an explicit stack:
+    // evaluation of a cell then finds every referenced value in cache and does not recurse
+    void ResolveReferences(Position pos);
+
+    // Number of cells changed or invalidated since the last recalculation
+    size_t DirtyCount() const;
+
+    // Collision and probe-length statistics of all maps inside the graph
+    FlatMapStats GetStats() const;
 
   private:
     SheetInterface &sheet_;
+    TiledTable<Cell> &cells_;
     LinkedCellsStorage referenced_cells_;
     LinkedCellsStorage dependants_;
+    FlatPositionMap<RangesStorage> referenced_ranges_;
+    FlatPositionMap<RangeDependants> range_dependants_; // keyed by tile
+    CellsStorage dirty_;
+    VertexTagger order_; // position of the cell in the topological order
+    int min_order_{0};
+    int max_order_{0};
+
+    // Adds all dependencies of pos, on failure removes the added ones and returns false
+    bool AddEdges(Position pos, const std::vector<Position> &cells, const std::vector<Range> &ranges);
+
+    // Adds dependency of `to` on `from`, returns false and changes nothing if it closes a cycle
+    bool AddEdge(Position from, Position to);
+
+    void RemoveEdge(Position from, Position to);
+
+    // Removes cell from the links of key, a key left without links is erased: cells without
+    // dependencies or dependants have no entries
+    static void Unlink(LinkedCellsStorage &links, Position key, Position cell);
+
+    // Removes every dependency of pos and returns them
+    std::pair<CellsStorage, RangesStorage> TakeDependencies(Position pos);
 
-    bool HasCircularDependency(Position pos) const;
+    // Adds dependency of `to` on every cell of the range
+    bool AddRangeEdge(Range range, Position to);
+
+    // Stores dependency of `to` on the range without any order checks
+    void LinkRange(Range range, Position to);
+
+    void RemoveRangeEdge(Range range, Position to);
+
+    void UnregisterRange(Range range, Position to);
+
+    // Returns order of pos, a cell without one is placed after every other cell
+    // and before formulas over ranges containing it
+    int EnsureOrder(Position pos);
+
+    // Moves cells of the affected region so that `from` precedes `to`,
+    // returns false if `to` already reaches `from`
+    bool Reorder(Position from, Position to, int lower, int upper);
+
+    // Collects cells reachable from the given ones into `sorted`, dependants before the cells they
+    // depend on. Returns the cells lying on cycles, `sorted` is not a topological order then
+    std::vector<Position> SortReachable(const std::vector<Position> &cells, std::vector<Position> &sorted) const;
+
+    // Renumbers the topological order from zero, keeping it
+    void CompactOrder();
 
     void PurgeCache(Position pos);
 
-    void CircularDepsDFS(Position pos, VertexTagger &tags, bool &is_cyclic) const;
+    // Cell for reading: GetCell of the non-const sheet is kept for changes, it may copy storage
+    const Cell *FindCell(Position pos) const;
+
+    // Pushes uncached cells referenced by pos, not expanded yet
+    void PushUncachedReferences(Position pos, std::vector<std::pair<Position, bool>> &stack) const;
 
-    void PurgeCacheDFS(Position pos, VertexTagger &visited);
+    // Calls func(Position) for cells depending on pos directly or through a range,
+    // a cell is visited once for every such dependency
+    template <typename Func> void ForEachDependant(Position pos, Func func) const;
+
+    template <typename Func> void ForEachRangeDependant(Position pos, Func func) const;
+
+    // Calls func(Position, int order) for cells of the range which have an order
+    template <typename Func> void ForEachOrderedCell(Range range, Func func) const;
+
+    // Calls func(Position) for every tile key overlapped by the range
+    template <typename Func> static void ForEachRangeTile(Range range, Func func);
 };
 
+// Cell of a sheet: the content and nothing else, the position, sheet and graph are passed as context
 class Cell : public CellInterface
 {
   public:
     Cell() = default;
 
-    ~Cell() override = default;
+    // Copies share the content, see CellContent::PurgeCache
+    Cell(const Cell &) = default;
 
-    Cell &SetPosition(Position pos);
+    Cell(Cell &&) = default;
+
+    Cell &operator=(const Cell &) = default;
+
+    Cell &operator=(Cell &&) = default;
+
+    ~Cell() override = default;
 
-    Cell &SetSheet(SheetInterface *sheet);
+    // Content of a cell outside of a sheet, references of its formula read as empty cells.
+    // A sheet changes its cells with SetContent, from outside they are changed through SheetCell
+    void Set(std::string text) override;
 
-    Cell &SetGraph(Graph *graph);
+    // Replaces the content, the caller updates dependencies of the cell in the graph.
+    // Dependants have to be invalidated through the graph whatever the new content is
+    void SetContent(CellContent content);
 
-    void Set(std::string text) override; // cyclic graph check here
+    // True if the text sets a formula, the expression follows FORMULA_SIGN
+    static bool IsFormulaText(std::string_view text);
 
     Value GetValue() const override;
 
-    void Clear();
+    ValueView GetValueView() const override;
+
+    // Removes dependencies of the cell from the graph of the context
+    void Clear(const CellContext &context);
 
     std::string GetText() const override;
 
-    std::vector<Position> GetReferencedCells() const override;
+    // Same text as GetText() without a copy, valid until the cell is changed or moved.
+    // A sheet moves its cells only when it copies a tile shared with a snapshot, see Sheet::GetCell
+    std::string_view GetTextView() const;
+
+    const std::vector<Position> &GetReferencedCells() const override;
+
+    std::optional<NumericValue> GetNumericValue() const override;
+
+    const std::vector<Range> &GetReferencedRanges() const;
+
+    // True if the cell has no text
+    bool IsEmpty() const;
+
+    // False if the value of the formula has to be computed
+    bool IsCached() const;
+
+    // Computes the value of the formula whose referenced cells are evaluated already
+    void Evaluate() const;
 
     void PurgeCache();
 
   private:
-    Position pos_{Position::NONE};
-    SheetInterface *sheet_{nullptr};
-    Graph *graph_{nullptr};
-    std::unique_ptr<Impl> impl_{std::make_unique<EmptyImpl>()};
+    CellContent content_;
 };
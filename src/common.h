@@ -1,10 +1,13 @@
 #pragma once
 
+#include <cstdint>
 #include <iosfwd>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <utility>
 #include <variant>
 #include <vector>
 
@@ -28,11 +31,37 @@ struct Position
     static const int MAX_COLS = 16384;
     static const Position NONE;
 
+    // Обе координаты корректной позиции помещаются в 14 бит, поэтому позицию
+    // можно упаковать в 32-битный ключ.
+    static const int PACKED_COL_BITS = 14;
+
+    uint32_t Pack() const
+    {
+        return static_cast<uint32_t>(row) << PACKED_COL_BITS | static_cast<uint32_t>(col);
+    }
+
+    static Position Unpack(uint32_t key)
+    {
+        return {static_cast<int>(key >> PACKED_COL_BITS), static_cast<int>(key & ((1u << PACKED_COL_BITS) - 1))};
+    }
+
+    // Перемешивает биты упакованного ключа (финализатор MurmurHash3), чтобы
+    // соседние позиции и диагонали не попадали в одну корзину.
+    static uint32_t MixKey(uint32_t key)
+    {
+        key ^= key >> 16;
+        key *= 0x85ebca6bu;
+        key ^= key >> 13;
+        key *= 0xc2b2ae35u;
+        key ^= key >> 16;
+        return key;
+    }
+
     struct Hasher
     {
         size_t operator()(const Position &pos) const
         {
-            return pos.row + 37 * pos.col;
+            return MixKey(pos.Pack());
         }
     };
 };
@@ -53,6 +82,28 @@ struct Size
     Size(const Size &other);
 };
 
+// Прямоугольный диапазон ячеек, например A1:B10. Углы включаются в диапазон.
+struct Range
+{
+    Position first; // левый верхний угол
+    Position last;  // правый нижний угол
+
+    // Строит диапазон по двум любым противоположным углам
+    static Range Between(Position lhs, Position rhs);
+
+    bool operator==(Range rhs) const;
+
+    bool operator<(Range rhs) const;
+
+    bool IsValid() const;
+
+    bool Contains(Position pos) const;
+
+    size_t CellCount() const;
+
+    std::string ToString() const;
+};
+
 // Описывает ошибки, которые могут возникнуть при вычислении формулы.
 class FormulaError
 {
@@ -82,6 +133,9 @@ std::ostream &operator<<(std::ostream &output, FormulaError fe);
 
 std::ostream &operator<<(std::ostream &output, FormulaError::Category fe);
 
+// Значение ячейки, каким его видят формулы: число или ошибка
+using NumericValue = std::variant<double, FormulaError>;
+
 // Исключение, выбрасываемое при попытке передать в метод некорректную позицию
 class InvalidPositionException : public std::out_of_range
 {
@@ -95,6 +149,21 @@ class FormulaException : public std::runtime_error
 {
   public:
     using std::runtime_error::runtime_error;
+
+    FormulaException(const std::string &what, std::vector<std::pair<Position, std::string>> errors)
+        : std::runtime_error(what), errors_(std::move(errors))
+    {
+    }
+
+    // Некорректные формулы при установке нескольких ячеек сразу: позиция ячейки
+    // и сообщение об ошибке, в порядке возрастания позиций. Пусто для одной формулы
+    const std::vector<std::pair<Position, std::string>> &GetErrors() const
+    {
+        return errors_;
+    }
+
+  private:
+    std::vector<std::pair<Position, std::string>> errors_;
 };
 
 // Исключение, выбрасываемое при попытке задать формулу, которая приводит к
@@ -103,6 +172,21 @@ class CircularDependencyException : public std::runtime_error
 {
   public:
     using std::runtime_error::runtime_error;
+
+    CircularDependencyException(const std::string &what, std::vector<Position> cells)
+        : std::runtime_error(what), cells_(std::move(cells))
+    {
+    }
+
+    // Ячейки, лежащие на циклах, в порядке возрастания позиций.
+    // Пусто, если исключение создано без списка ячеек
+    const std::vector<Position> &GetCells() const
+    {
+        return cells_;
+    }
+
+  private:
+    std::vector<Position> cells_;
 };
 
 // Исключение, выбрасываемое, если вставка строк/столбцов в таблицу приведёт к
@@ -123,6 +207,9 @@ class CellInterface
     // формулы
     using Value = std::variant<std::string, double, FormulaError>;
 
+    // То же значение, но текст не копируется, а ссылается на память ячейки
+    using ValueView = std::variant<std::string_view, double, FormulaError>;
+
     virtual ~CellInterface() = default;
 
     // Задаёт содержимое ячейки. Если текст начинается со знака "=", то он
@@ -139,6 +226,12 @@ class CellInterface
     // случае формулы - числовое значение формулы или сообщение об ошибке.
     virtual Value GetValue() const = 0;
 
+    // Возвращает видимое значение ячейки, как GetValue(), но без копирования
+    // текста. Короткий текст хранится в самой ячейке, поэтому представление
+    // действительно, пока ячейка не изменена и не удалена из таблицы. Таблица
+    // может сократить этот срок, см. описание её GetCell().
+    virtual ValueView GetValueView() const = 0;
+
     // Возвращает внутренний текст ячейки, как если бы мы начали её
     // редактирование. В случае текстовой ячейки это её текст (возможно,
     // содержащий экранирующие символы). В случае формулы - её выражение.
@@ -146,8 +239,17 @@ class CellInterface
 
     // Возвращает список ячеек, которые непосредственно задействованы в данной
     // формуле. Список отсортирован по возрастанию и не содержит повторяющихся
-    // ячеек. В случае текстовой ячейки список пуст.
-    virtual std::vector<Position> GetReferencedCells() const = 0;
+    // ячеек. В случае текстовой ячейки список пуст. Список вычисляется один
+    // раз при разборе формулы, ссылка на него действительна, пока ячейка не
+    // изменена.
+    virtual const std::vector<Position> &GetReferencedCells() const = 0;
+
+    // Возвращает значение ячейки для вычисления формул, не копируя её текст.
+    // Текст ячейки разбирается как число один раз, при вызове Set(). Если
+    // текст не является числом, возвращается ошибка #VALUE!. Для пустого
+    // видимого значения возвращается std::nullopt: в выражениях оно считается
+    // нулём, а функции над диапазонами его пропускают.
+    virtual std::optional<NumericValue> GetNumericValue() const = 0;
 };
 
 // Интерфейс таблицы
@@ -166,6 +268,8 @@ class SheetInterface
     // Если ячейка пуста, может вернуть nullptr.
     virtual const CellInterface *GetCell(Position pos) const = 0;
 
+    // Изменение ячейки методом Set() равносильно вызову SetCell() для её
+    // позиции.
     virtual CellInterface *GetCell(Position pos) = 0;
 
     // Очищает ячейку.
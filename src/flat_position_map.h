@@ -0,0 +1,417 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <utility>
+
+// Collision and probe-length statistics of a flat map,
+// probe length of a key is the number of slots inspected to find it
+struct FlatMapStats
+{
+    size_t size = 0;
+    size_t capacity = 0;
+    size_t displaced = 0; // keys which are not stored in their home slot
+    size_t max_probe_length = 0;
+    size_t total_probe_length = 0;
+
+    double LoadFactor() const
+    {
+        return capacity ? static_cast<double>(size) / capacity : 0.0;
+    }
+
+    double MeanProbeLength() const
+    {
+        return size ? static_cast<double>(total_probe_length) / size : 0.0;
+    }
+
+    FlatMapStats &operator+=(const FlatMapStats &other)
+    {
+        size += other.size;
+        capacity += other.capacity;
+        displaced += other.displaced;
+        max_probe_length = std::max(max_probe_length, other.max_probe_length);
+        total_probe_length += other.total_probe_length;
+        return *this;
+    }
+};
+
+// Open-addressing hash map from valid positions to values.
+// Keys are positions packed into 32 bits, the table uses linear probing with
+// backward-shift deletion, so there are no tombstones. Values are stored inline and
+// are moved when the table grows: pointers to them are invalidated by insertions.
+template <typename V> class FlatPositionMap
+{
+  public:
+    class PositionIterator
+    {
+      public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Position;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const Position *;
+        using reference = Position;
+
+        PositionIterator(const uint32_t *key, const uint32_t *end) : key_(key), end_(end)
+        {
+            SkipEmpty();
+        }
+
+        Position operator*() const
+        {
+            return Position::Unpack(*key_);
+        }
+
+        PositionIterator &operator++()
+        {
+            ++key_;
+            SkipEmpty();
+            return *this;
+        }
+
+        bool operator==(const PositionIterator &other) const
+        {
+            return key_ == other.key_;
+        }
+
+        bool operator!=(const PositionIterator &other) const
+        {
+            return key_ != other.key_;
+        }
+
+      private:
+        const uint32_t *key_;
+        const uint32_t *end_;
+
+        void SkipEmpty()
+        {
+            while (key_ != end_ && *key_ == EMPTY_KEY)
+                ++key_;
+        }
+    };
+
+    FlatPositionMap() = default;
+
+    FlatPositionMap(const FlatPositionMap &other)
+    {
+        *this = other;
+    }
+
+    FlatPositionMap(FlatPositionMap &&other) noexcept
+        : keys_(std::move(other.keys_)), values_(std::move(other.values_)), capacity_(other.capacity_),
+          size_(other.size_)
+    {
+        other.capacity_ = other.size_ = 0;
+    }
+
+    FlatPositionMap &operator=(const FlatPositionMap &other)
+    {
+        if (this == &other)
+            return *this;
+        Clear();
+        Reserve(other.size_);
+        other.ForEach([this](Position pos, const V &value) { Emplace(pos) = value; });
+        return *this;
+    }
+
+    FlatPositionMap &operator=(FlatPositionMap &&other) noexcept
+    {
+        if (this == &other)
+            return *this;
+        Destroy();
+        keys_ = std::move(other.keys_);
+        values_ = std::move(other.values_);
+        capacity_ = other.capacity_;
+        size_ = other.size_;
+        other.capacity_ = other.size_ = 0;
+        return *this;
+    }
+
+    ~FlatPositionMap()
+    {
+        Destroy();
+    }
+
+    V *Find(Position pos)
+    {
+        size_t slot = FindSlot(pos.Pack());
+        return slot == NPOS ? nullptr : Value(slot);
+    }
+
+    const V *Find(Position pos) const
+    {
+        return const_cast<FlatPositionMap *>(this)->Find(pos);
+    }
+
+    bool Contains(Position pos) const
+    {
+        return FindSlot(pos.Pack()) != NPOS;
+    }
+
+    // Returns value stored for pos, default-constructs it first if there is none
+    V &Emplace(Position pos)
+    {
+        return *TryEmplace(pos).first;
+    }
+
+    // Second is true if the value has been created by this call
+    std::pair<V *, bool> TryEmplace(Position pos)
+    {
+        const uint32_t key = pos.Pack();
+        if (size_t slot = FindSlot(key); slot != NPOS)
+            return {Value(slot), false};
+
+        if ((size_ + 1) * MAX_LOAD_DENOMINATOR > capacity_ * MAX_LOAD_NUMERATOR)
+            Rehash(std::max(capacity_ * 2, MIN_CAPACITY));
+
+        size_t slot = HomeSlot(key);
+        while (keys_[slot] != EMPTY_KEY)
+            slot = (slot + 1) & (capacity_ - 1);
+        keys_[slot] = key;
+        new (&values_[slot]) V();
+        ++size_;
+        return {Value(slot), true};
+    }
+
+    // Returns false if there was nothing to erase
+    bool Erase(Position pos)
+    {
+        size_t hole = FindSlot(pos.Pack());
+        if (hole == NPOS)
+            return false;
+        Value(hole)->~V();
+        --size_;
+
+        // shift following entries of the cluster back so that no probe sequence is broken
+        const size_t mask = capacity_ - 1;
+        for (size_t slot = (hole + 1) & mask; keys_[slot] != EMPTY_KEY; slot = (slot + 1) & mask)
+        {
+            size_t home = HomeSlot(keys_[slot]);
+            if (((slot - home) & mask) < ((slot - hole) & mask))
+                continue; // entry can not be moved closer to its home slot
+            keys_[hole] = keys_[slot];
+            new (&values_[hole]) V(std::move(*Value(slot)));
+            Value(slot)->~V();
+            hole = slot;
+        }
+        keys_[hole] = EMPTY_KEY;
+        return true;
+    }
+
+    void Clear()
+    {
+        Destroy();
+        keys_.reset();
+        values_.reset();
+        capacity_ = size_ = 0;
+    }
+
+    void Reserve(size_t size)
+    {
+        size_t capacity = MIN_CAPACITY;
+        while (size * MAX_LOAD_DENOMINATOR > capacity * MAX_LOAD_NUMERATOR)
+            capacity *= 2;
+        if (capacity > capacity_)
+            Rehash(capacity);
+    }
+
+    size_t Size() const
+    {
+        return size_;
+    }
+
+    bool IsEmpty() const
+    {
+        return size_ == 0;
+    }
+
+    size_t AllocatedBytes() const
+    {
+        return capacity_ * (sizeof(uint32_t) + sizeof(Storage));
+    }
+
+    // Calls func(Position, V &) for every stored value, order is unspecified
+    template <typename Func> void ForEach(Func func)
+    {
+        for (size_t slot = 0; slot < capacity_; ++slot)
+        {
+            if (keys_[slot] != EMPTY_KEY)
+                func(Position::Unpack(keys_[slot]), *Value(slot));
+        }
+    }
+
+    template <typename Func> void ForEach(Func func) const
+    {
+        for (size_t slot = 0; slot < capacity_; ++slot)
+        {
+            if (keys_[slot] != EMPTY_KEY)
+                func(Position::Unpack(keys_[slot]), static_cast<const V &>(*Value(slot)));
+        }
+    }
+
+    PositionIterator KeysBegin() const
+    {
+        return {keys_.get(), keys_.get() + capacity_};
+    }
+
+    PositionIterator KeysEnd() const
+    {
+        return {keys_.get() + capacity_, keys_.get() + capacity_};
+    }
+
+    FlatMapStats GetStats() const
+    {
+        FlatMapStats stats;
+        stats.size = size_;
+        stats.capacity = capacity_;
+        for (size_t slot = 0; slot < capacity_; ++slot)
+        {
+            if (keys_[slot] == EMPTY_KEY)
+                continue;
+            size_t probe_length = ((slot - HomeSlot(keys_[slot])) & (capacity_ - 1)) + 1;
+            stats.displaced += probe_length > 1;
+            stats.max_probe_length = std::max(stats.max_probe_length, probe_length);
+            stats.total_probe_length += probe_length;
+        }
+        return stats;
+    }
+
+  private:
+    struct alignas(V) Storage
+    {
+        unsigned char bytes[sizeof(V)];
+    };
+
+    static constexpr uint32_t EMPTY_KEY = UINT32_MAX;
+    static constexpr size_t NPOS = SIZE_MAX;
+    static constexpr size_t MIN_CAPACITY = 8;
+    static constexpr size_t MAX_LOAD_NUMERATOR = 3;
+    static constexpr size_t MAX_LOAD_DENOMINATOR = 4;
+
+    std::unique_ptr<uint32_t[]> keys_;
+    std::unique_ptr<Storage[]> values_;
+    size_t capacity_ = 0; // always a power of two
+    size_t size_ = 0;
+
+    V *Value(size_t slot) const
+    {
+        return std::launder(reinterpret_cast<V *>(&values_[slot]));
+    }
+
+    size_t HomeSlot(uint32_t key) const
+    {
+        return Position::MixKey(key) & (capacity_ - 1);
+    }
+
+    size_t FindSlot(uint32_t key) const
+    {
+        if (size_ == 0)
+            return NPOS;
+        for (size_t slot = HomeSlot(key);; slot = (slot + 1) & (capacity_ - 1))
+        {
+            if (keys_[slot] == key)
+                return slot;
+            if (keys_[slot] == EMPTY_KEY)
+                return NPOS;
+        }
+    }
+
+    void Rehash(size_t capacity)
+    {
+        auto old_keys = std::move(keys_);
+        auto old_values = std::move(values_);
+        const size_t old_capacity = capacity_;
+
+        keys_ = std::make_unique<uint32_t[]>(capacity);
+        std::fill(keys_.get(), keys_.get() + capacity, EMPTY_KEY);
+        values_ = std::make_unique<Storage[]>(capacity);
+        capacity_ = capacity;
+
+        for (size_t old_slot = 0; old_slot < old_capacity; ++old_slot)
+        {
+            if (old_keys[old_slot] == EMPTY_KEY)
+                continue;
+            size_t slot = HomeSlot(old_keys[old_slot]);
+            while (keys_[slot] != EMPTY_KEY)
+                slot = (slot + 1) & (capacity_ - 1);
+            keys_[slot] = old_keys[old_slot];
+            V *old_value = std::launder(reinterpret_cast<V *>(&old_values[old_slot]));
+            new (&values_[slot]) V(std::move(*old_value));
+            old_value->~V();
+        }
+    }
+
+    void Destroy()
+    {
+        for (size_t slot = 0; slot < capacity_; ++slot)
+        {
+            if (keys_[slot] != EMPTY_KEY)
+                Value(slot)->~V();
+        }
+    }
+};
+
+// Set of valid positions on top of FlatPositionMap
+class FlatPositionSet
+{
+  public:
+    using const_iterator = FlatPositionMap<bool>::PositionIterator;
+
+    FlatPositionSet() = default;
+
+    template <typename It> FlatPositionSet(It first, It last)
+    {
+        map_.Reserve(std::distance(first, last));
+        for (; first != last; ++first)
+            Insert(*first);
+    }
+
+    // Returns false if pos was already in the set
+    bool Insert(Position pos)
+    {
+        return map_.TryEmplace(pos).second;
+    }
+
+    bool Erase(Position pos)
+    {
+        return map_.Erase(pos);
+    }
+
+    bool Contains(Position pos) const
+    {
+        return map_.Contains(pos);
+    }
+
+    size_t Size() const
+    {
+        return map_.Size();
+    }
+
+    bool IsEmpty() const
+    {
+        return map_.IsEmpty();
+    }
+
+    const_iterator begin() const
+    {
+        return map_.KeysBegin();
+    }
+
+    const_iterator end() const
+    {
+        return map_.KeysEnd();
+    }
+
+    FlatMapStats GetStats() const
+    {
+        return map_.GetStats();
+    }
+
+  private:
+    FlatPositionMap<bool> map_;
+};
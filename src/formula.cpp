@@ -1,8 +1,9 @@
 #include "formula.h"
 #include "FormulaAST.h"
+#include "thread_pool.h"
 
 #include <algorithm>
-#include <sstream>
+#include <optional>
 
 using namespace std::literals;
 
@@ -21,53 +22,221 @@ namespace
 class Formula : public FormulaInterface
 {
   public:
-    explicit Formula(std::string expression);
+    explicit Formula(std::shared_ptr<const FormulaAST> ast);
+
+    // Formula of the same shape as ast with references shifted by (row, col)
+    Formula(std::shared_ptr<const FormulaAST> ast, Position shift);
 
     Value Evaluate(const SheetInterface &sheet) const override;
 
+    Value Evaluate(const SheetInterface &sheet, const CellInterface *const *cells) const override;
+
     std::string GetExpression() const override;
 
-    std::vector<Position> GetReferencedCells() const override;
+    const std::vector<Position> &GetReferencedCells() const override;
+
+    const std::vector<Range> &GetReferencedRanges() const override;
 
   private:
-    FormulaAST ast_;
+    std::shared_ptr<const FormulaAST> ast_; // may be shared by formulas of the same shape
+    ASTImpl::References refs_;
 };
 
-Formula::Formula(std::string expression) : ast_(ParseFormulaAST(std::move(expression)))
+Formula::Formula(std::shared_ptr<const FormulaAST> ast) : ast_(std::move(ast)), refs_(ast_->GetReferences())
 {
 }
 
+Formula::Formula(std::shared_ptr<const FormulaAST> ast, Position shift) : ast_(std::move(ast))
+{
+    // a shift keeps the order of positions and ranges
+    const ASTImpl::References &refs = ast_->GetReferences();
+    refs_.cells.reserve(refs.cells.size());
+    for (Position pos : refs.cells)
+        refs_.cells.push_back({pos.row + shift.row, pos.col + shift.col});
+    refs_.ranges.reserve(refs.ranges.size());
+    for (const Range &range : refs.ranges)
+        refs_.ranges.push_back({{range.first.row + shift.row, range.first.col + shift.col},
+                                {range.last.row + shift.row, range.last.col + shift.col}});
+}
+
 FormulaInterface::Value Formula::Evaluate(const SheetInterface &sheet) const
 {
-    try
+    return ast_->Execute(sheet, refs_);
+}
+
+FormulaInterface::Value Formula::Evaluate(const SheetInterface &sheet, const CellInterface *const *cells) const
+{
+    return ast_->Execute(sheet, refs_, cells);
+}
+
+const std::vector<Position> &Formula::GetReferencedCells() const
+{
+    return refs_.cells;
+}
+
+const std::vector<Range> &Formula::GetReferencedRanges() const
+{
+    return refs_.ranges;
+}
+
+std::string Formula::GetExpression() const
+{
+    return ast_->GetExpression(refs_);
+}
+
+} // namespace
+
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression)
+{
+    return std::make_unique<Formula>(std::make_shared<const FormulaAST>(ParseFormulaAST(std::move(expression))));
+}
+
+std::unique_ptr<FormulaInterface> FormulaCache::ParseFormula(std::string expression, Position pos)
+{
+    auto key = MakeRelativeFormulaKey(expression, pos);
+    if (!key)
+        return ::ParseFormula(std::move(expression));
+
+    auto [entry, inserted] = entries_.try_emplace(std::move(*key));
+    if (!inserted)
     {
-        return ast_.Execute(sheet);
+        if (auto ast = entry->second.ast.lock())
+        {
+            const Position shift{pos.row - entry->second.anchor.row, pos.col - entry->second.anchor.col};
+            return std::make_unique<Formula>(std::move(ast), shift);
+        }
     }
-    catch (const FormulaError &fe)
+
+    std::shared_ptr<const FormulaAST> ast;
+    try
     {
-        return fe;
+        ast = std::make_shared<const FormulaAST>(ParseFormulaAST(std::move(expression)));
     }
-    catch (const std::exception &ex)
+    catch (...)
     {
-        return FormulaError(FormulaError::Category::Value);
+        entries_.erase(entry);
+        throw;
     }
+    entry->second = {ast, pos};
+    if (entries_.size() >= purge_size_)
+        PurgeExpired();
+    return std::make_unique<Formula>(std::move(ast));
 }
 
-std::vector<Position> Formula::GetReferencedCells() const
+std::vector<std::unique_ptr<FormulaInterface>> FormulaCache::ParseFormulas(
+    const std::vector<std::pair<Position, std::string_view>> &expressions, ThreadPool *pool)
 {
-    return ast_.GetReferencedCells();
+    constexpr size_t CHUNK_SIZE = 64;
+    const size_t count = expressions.size();
+    std::vector<std::optional<std::string>> keys(count);
+    ParallelFor(pool, count, CHUNK_SIZE, [&expressions, &keys](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i)
+            keys[i] = MakeRelativeFormulaKey(expressions[i].second, expressions[i].first);
+    });
+
+    // a shape is parsed once, for the first formula of it which is not in the cache
+    struct Source
+    {
+        std::shared_ptr<const FormulaAST> ast;
+        Position anchor;
+        std::string error;
+    };
+    std::vector<Source> sources;
+    std::vector<size_t> parsed; // indices of formulas to parse, one for every new source
+    std::vector<size_t> source_of(count);
+    std::unordered_map<std::string_view, size_t> new_sources;
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (keys[i])
+        {
+            if (auto entry = entries_.find(*keys[i]); entry != entries_.end())
+            {
+                if (auto ast = entry->second.ast.lock())
+                {
+                    source_of[i] = sources.size();
+                    sources.push_back({std::move(ast), entry->second.anchor, {}});
+                    continue;
+                }
+            }
+            auto [source, inserted] = new_sources.try_emplace(*keys[i], sources.size());
+            if (!inserted)
+            {
+                source_of[i] = source->second;
+                continue;
+            }
+        }
+        source_of[i] = sources.size();
+        sources.push_back({nullptr, expressions[i].first, {}});
+        parsed.push_back(i);
+    }
+
+    ParallelFor(pool, parsed.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t k = begin; k < end; ++k)
+        {
+            const size_t i = parsed[k];
+            try
+            {
+                sources[source_of[i]].ast = std::make_shared<const FormulaAST>(
+                    ParseFormulaAST(expressions[i].second, GetDefaultFormulaParserMode()));
+            }
+            catch (const FormulaException &exc)
+            {
+                sources[source_of[i]].error = exc.what();
+            }
+        }
+    });
+
+    std::vector<std::pair<Position, std::string>> errors;
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (const Source &source = sources[source_of[i]]; !source.ast)
+            errors.emplace_back(expressions[i].first, source.error);
+    }
+    if (!errors.empty())
+    {
+        std::sort(errors.begin(), errors.end(),
+                  [](const auto &lhs, const auto &rhs) { return lhs.first < rhs.first; });
+        std::string message = errors.front().first.ToString() + ": " + errors.front().second;
+        if (errors.size() > 1)
+            message += " and " + std::to_string(errors.size() - 1) + " more incorrect formulas";
+        throw FormulaException(message, std::move(errors));
+    }
+
+    for (size_t i : parsed)
+    {
+        if (keys[i])
+            entries_[std::move(*keys[i])] = {sources[source_of[i]].ast, expressions[i].first};
+    }
+    if (entries_.size() >= purge_size_)
+        PurgeExpired();
+
+    std::vector<std::unique_ptr<FormulaInterface>> result(count);
+    ParallelFor(pool, count, CHUNK_SIZE, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i)
+        {
+            const Source &source = sources[source_of[i]];
+            const Position pos = expressions[i].first;
+            result[i] = std::make_unique<Formula>(
+                source.ast, Position{pos.row - source.anchor.row, pos.col - source.anchor.col});
+        }
+    });
+    return result;
 }
 
-std::string Formula::GetExpression() const
+size_t FormulaCache::GetSharedCount() const
 {
-    std::ostringstream out;
-    ast_.PrintFormula(out);
-    return out.str();
+    return std::count_if(entries_.begin(), entries_.end(),
+                         [](const auto &entry) { return !entry.second.ast.expired(); });
 }
 
-} // namespace
-
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression)
+void FormulaCache::PurgeExpired()
 {
-    return std::make_unique<Formula>(std::move(expression));
+    for (auto it = entries_.begin(); it != entries_.end();)
+    {
+        if (it->second.ast.expired())
+            it = entries_.erase(it);
+        else
+            ++it;
+    }
+    purge_size_ = std::max(MIN_PURGE_SIZE, entries_.size() * 2);
 }
@@ -5,11 +5,18 @@
 #include "FormulaAST.h"
 
 #include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
 #include <variant>
+#include <vector>
+
+class ThreadPool;
 
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
+// * Агрегатные функции SUM, AVERAGE, MIN, MAX, COUNT от диапазонов и выражений: SUM(A1:B10,C1*2)
 class FormulaInterface
 {
   public:
@@ -21,16 +28,64 @@ class FormulaInterface
     // мы создали только 1 вид ошибки -- деление на 0.
     virtual Value Evaluate(const SheetInterface &sheet) const = 0;
 
+    // То же, но ячейки, на которые ссылается формула, уже найдены в таблице:
+    // cells[i] -- ячейка из GetReferencedCells()[i] или nullptr, если её нет.
+    // Значения этих ячеек читаются без поиска по таблице.
+    virtual Value Evaluate(const SheetInterface &sheet, const CellInterface *const *cells) const = 0;
+
     // Возвращает выражение, которое описывает формулу.
     // Не содержит пробелов и лишних скобок.
     virtual std::string GetExpression() const = 0;
 
     // Возвращает список ячеек, которые непосредственно задействованы в вычислении
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
-    // ячеек.
-    virtual std::vector<Position> GetReferencedCells() const = 0;
+    // ячеек. Список строится один раз при разборе формулы.
+    virtual const std::vector<Position> &GetReferencedCells() const = 0;
+
+    // Возвращает список диапазонов, которые используются как аргументы функций.
+    // Ячейки диапазонов не входят в GetReferencedCells(). Список отсортирован по
+    // возрастанию и не содержит повторений.
+    virtual const std::vector<Range> &GetReferencedRanges() const = 0;
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// Общие скомпилированные формулы. Формулы, которые отличаются только сдвигом
+// ссылок (например, =B2*C2 в ячейке D2 и =B3*C3 в ячейке D3), разбираются
+// один раз и разделяют неизменяемое тело, у каждой формулы остаются только
+// её собственные ссылки.
+class FormulaCache
+{
+  public:
+    // Как ParseFormula(), но для формулы ячейки pos: если формула такой же
+    // формы уже разобрана и ещё используется, разбор не выполняется.
+    std::unique_ptr<FormulaInterface> ParseFormula(std::string expression, Position pos);
+
+    // Разбирает формулы нескольких ячеек: разбор выполняется на потоках pool
+    // (без него -- на вызывающем потоке), формулы одной формы разбираются один
+    // раз. Возвращает формулы в порядке аргументов. Если некорректна хотя бы
+    // одна формула, бросает FormulaException со списком всех некорректных
+    // ячеек, кэш при этом не меняется.
+    std::vector<std::unique_ptr<FormulaInterface>> ParseFormulas(
+        const std::vector<std::pair<Position, std::string_view>> &expressions, ThreadPool *pool);
+
+    // Количество используемых тел формул
+    size_t GetSharedCount() const;
+
+  private:
+    static constexpr size_t MIN_PURGE_SIZE = 1024;
+
+    // Тело и позиция ячейки, ссылки которой в нём записаны
+    struct Entry
+    {
+        std::weak_ptr<const FormulaAST> ast;
+        Position anchor;
+    };
+
+    std::unordered_map<std::string, Entry> entries_;
+    size_t purge_size_ = MIN_PURGE_SIZE;
+
+    void PurgeExpired();
+};
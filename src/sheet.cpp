@@ -2,12 +2,106 @@
 
 #include "common.h"
 
+#include <algorithm>
+#include <chrono>
 #include <functional>
 #include <iostream>
+#include <utility>
 
 using namespace std::literals;
 
-Sheet::Sheet() : table_{}, size_{0, 0}, graph_(*this)
+namespace
+{
+// Prints size.rows lines of size.cols tab-separated cells
+template <typename Func>
+void PrintCells(const TiledTable<Cell> &table, Size size, std::ostream &output, Func print_cell)
+{
+    for (int i = 0; i < size.rows; ++i)
+    {
+        for (int k = 0; k < size.cols; ++k)
+        {
+            if (const Cell *cell = table.Find({i, k}))
+            {
+                print_cell(*cell);
+            }
+            if (k != size.cols - 1)
+            {
+                output << "\t";
+            }
+        }
+        output << "\n";
+    }
+}
+} // namespace
+
+void PrintableArea::Add(Position pos)
+{
+    ++rows_[pos.row];
+    ++cols_[pos.col];
+}
+
+void PrintableArea::Remove(Position pos)
+{
+    Decrement(rows_, pos.row);
+    Decrement(cols_, pos.col);
+}
+
+Size PrintableArea::GetSize() const
+{
+    if (rows_.empty())
+        return {0, 0};
+    return {rows_.rbegin()->first + 1, cols_.rbegin()->first + 1};
+}
+
+void PrintableArea::Decrement(std::map<int, int> &counters, int index)
+{
+    auto it = counters.find(index);
+    if (--it->second == 0)
+        counters.erase(it);
+}
+
+SheetCell::SheetCell(Sheet &sheet, Position pos) : sheet_(sheet), pos_(pos)
+{
+}
+
+void SheetCell::Set(std::string text)
+{
+    sheet_.SetCell(pos_, std::move(text));
+}
+
+CellInterface::Value SheetCell::GetValue() const
+{
+    return GetStored().GetValue();
+}
+
+CellInterface::ValueView SheetCell::GetValueView() const
+{
+    return GetStored().GetValueView();
+}
+
+std::string SheetCell::GetText() const
+{
+    return GetStored().GetText();
+}
+
+const std::vector<Position> &SheetCell::GetReferencedCells() const
+{
+    return GetStored().GetReferencedCells();
+}
+
+std::optional<NumericValue> SheetCell::GetNumericValue() const
+{
+    return GetStored().GetNumericValue();
+}
+
+const CellInterface &SheetCell::GetStored() const
+{
+    static const Cell empty;
+    const CellInterface *cell = std::as_const(sheet_).GetCell(pos_);
+    return cell ? *cell : empty;
+}
+
+Sheet::Sheet() : table_{}, area_{}, graph_(*this, table_)
 {
 }
 
@@ -16,116 +110,305 @@ Sheet::~Sheet() = default;
 void Sheet::SetCell(Position pos, std::string text)
 {
     CheckCorrectness(pos);
-    if (table_.count(pos) && table_.at(pos).GetText() == text)
+    const WriteLock lock = LockForWriting();
+    const Cell *existing = std::as_const(table_).Find(pos);
+    if (existing && existing->GetTextView() == text)
+        return;
+    const bool was_empty = !existing || existing->IsEmpty();
+
+    // the cell is stored once its content is valid, a failed change leaves no empty cell behind
+    CellContent content(std::move(text), GetContext(pos));
+    if (!graph_.UpdateCell(pos, content.GetReferencedCells(), content.GetReferencedRanges()))
+    {
+        throw CircularDependencyException("Circular dependency detected");
+    }
+    ++version_;
+    Cell &cell = table_.Emplace(pos);
+    cell.SetContent(std::move(content));
+    if (was_empty && !cell.IsEmpty())
+        area_.Add(pos);
+    else if (!was_empty && cell.IsEmpty())
+        area_.Remove(pos);
+    RecalculateIfAutomatic();
+}
+
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells)
+{
+    for (const auto &[pos, text] : cells)
+        CheckCorrectness(pos);
+    const WriteLock lock = LockForWriting();
+
+    // the last text of a position wins, unchanged cells are skipped
+    FlatPositionMap<size_t> last_index;
+    last_index.Reserve(cells.size());
+    for (size_t i = 0; i < cells.size(); ++i)
+        last_index.Emplace(cells[i].first) = i;
+    std::vector<std::pair<Position, std::string>> changed;
+    changed.reserve(last_index.Size());
+    for (size_t i = 0; i < cells.size(); ++i)
+    {
+        auto &[pos, text] = cells[i];
+        if (*last_index.Find(pos) != i)
+            continue;
+        const Cell *existing = std::as_const(table_).Find(pos);
+        if (!existing || existing->GetTextView() != text)
+            changed.emplace_back(pos, std::move(text));
+    }
+    if (changed.empty())
         return;
 
-    table_[pos].SetPosition(pos).SetSheet(this).SetGraph(&graph_).Set(text);
-    for (const auto &cell : table_[pos].GetReferencedCells())
+    std::vector<std::pair<Position, std::string_view>> expressions;
+    std::vector<size_t> formula_cells; // index in `changed` of every expression
+    for (size_t i = 0; i < changed.size(); ++i)
     {
-        if (!table_.count(cell))
+        const auto &[pos, text] = changed[i];
+        if (Cell::IsFormulaText(text))
         {
-            table_[cell].Set(std::string{});
-            if (cell.row >= size_.rows)
-                size_.rows = cell.row + 1;
-            if (cell.col >= size_.cols)
-                size_.cols = cell.col + 1;
+            expressions.emplace_back(pos, std::string_view(text).substr(1));
+            formula_cells.push_back(i);
         }
     }
+    ThreadPool *pool = GetPool();
+    std::vector<std::unique_ptr<FormulaInterface>> parsed = formula_cache_.ParseFormulas(expressions, pool);
+    std::vector<std::unique_ptr<FormulaInterface>> formulas(changed.size());
+    for (size_t k = 0; k < parsed.size(); ++k)
+        formulas[formula_cells[k]] = std::move(parsed[k]);
+
+    // canonical texts of formulas are printed here, so contents are made in parallel too
+    std::vector<std::pair<Position, CellContent>> updates(changed.size());
+    ParallelFor(pool, changed.size(), 256, [this, &changed, &formulas, &updates](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i)
+        {
+            auto &[pos, text] = changed[i];
+            updates[i] = {pos, CellContent(std::move(text), std::move(formulas[i]), GetContext(pos))};
+        }
+    });
+
+    std::vector<Graph::CellDependencies> dependencies;
+    dependencies.reserve(updates.size());
+    for (const auto &[pos, content] : updates)
+        dependencies.push_back({pos, content.GetReferencedCells(), content.GetReferencedRanges()});
+    if (std::vector<Position> cyclic = graph_.UpdateCells(dependencies); !cyclic.empty())
+    {
+        throw CircularDependencyException("Circular dependency detected in " + ListCells(cyclic), std::move(cyclic));
+    }
+    ++version_;
 
-    if (pos.row >= size_.rows)
-        size_.rows = pos.row + 1;
-    if (pos.col >= size_.cols)
-        size_.cols = pos.col + 1;
+    for (auto &[pos, content] : updates)
+    {
+        const Cell *existing = std::as_const(table_).Find(pos);
+        const bool was_empty = !existing || existing->IsEmpty();
+        Cell &cell = table_.Emplace(pos);
+        cell.SetContent(std::move(content));
+        if (was_empty && !cell.IsEmpty())
+            area_.Add(pos);
+        else if (!was_empty && cell.IsEmpty())
+            area_.Remove(pos);
+    }
+    RecalculateIfAutomatic();
 }
 
 const CellInterface *Sheet::GetCell(Position pos) const
 {
     CheckCorrectness(pos);
-    if (table_.count(pos))
-    {
-        return &table_.at(pos);
-    }
-    return nullptr;
+    return table_.Find(pos);
 }
 
 CellInterface *Sheet::GetCell(Position pos)
 {
     CheckCorrectness(pos);
-    if (table_.count(pos))
-    {
-        return &table_.at(pos);
-    }
-    return nullptr;
+    if (!table_.Contains(pos))
+        return nullptr;
+    const std::lock_guard lock(sheet_cells_mutex_);
+    auto &cell = sheet_cells_.Emplace(pos);
+    if (!cell)
+        cell = std::make_unique<SheetCell>(*this, pos);
+    return cell.get();
 }
 
 void Sheet::ClearCell(Position pos)
 {
     CheckCorrectness(pos);
-    if (!table_.count(pos))
+    const WriteLock lock = LockForWriting();
+    Cell *cell = table_.FindMutable(pos);
+    if (!cell)
         return;
-    table_[pos].Clear();
-    table_.erase(pos);
-
-    int max_col{-1}, max_row{-1};
-    for (const auto &[p, _] : table_)
-    {
-        if (table_.at(p).GetText().empty())
-            continue;
-        max_row = std::max(p.row, max_row);
-        max_col = std::max(p.col, max_col);
-    }
-    size_ = Size{max_row + 1, max_col + 1};
+    if (!cell->IsEmpty())
+        area_.Remove(pos);
+    cell->Clear(GetContext(pos));
+    table_.Erase(pos);
+    ++version_;
+    RecalculateIfAutomatic();
 }
 
 Size Sheet::GetPrintableSize() const
 {
-    return size_;
+    return area_.GetSize();
 }
 
 void Sheet::PrintValues(std::ostream &output) const
 {
-    for (int i = 0; i < size_.rows; ++i)
-    {
-        for (int k = 0; k < size_.cols; ++k)
-        {
-            if (table_.count({i, k}))
-            {
-                output << table_.at({i, k}).GetValue();
-            }
-            if (k != size_.cols - 1)
-            {
-                output << "\t";
-            }
-        }
-        output << "\n";
-    }
+    PrintCells(table_, area_.GetSize(), output, [&output](const Cell &cell) { output << cell.GetValueView(); });
 }
 
 void Sheet::PrintTexts(std::ostream &output) const
 {
-    for (int i = 0; i < size_.rows; ++i)
+    PrintCells(table_, area_.GetSize(), output, [&output](const Cell &cell) { output << cell.GetTextView(); });
+}
+
+void Sheet::SetThreadCount(size_t count)
+{
+    const WriteLock lock = LockForWriting();
+    thread_count_ = std::max<size_t>(count, 1);
+    pool_.reset();
+}
+
+size_t Sheet::GetThreadCount() const
+{
+    return thread_count_;
+}
+
+CellContext Sheet::GetContext(Position pos)
+{
+    return {pos, this, &graph_, &formula_cache_, &table_};
+}
+
+ThreadPool *Sheet::GetPool()
+{
+    if (thread_count_ == 1)
+        return nullptr;
+    if (!pool_)
+        pool_ = std::make_unique<ThreadPool>(thread_count_);
+    return pool_.get();
+}
+
+void Sheet::SetRecalculationMode(RecalculationMode mode)
+{
+    const WriteLock lock = LockForWriting();
+    recalculation_mode_ = mode;
+    RecalculateIfAutomatic();
+}
+
+RecalculationMode Sheet::GetRecalculationMode() const
+{
+    return recalculation_mode_;
+}
+
+RecalculationStats Sheet::Recalculate()
+{
+    const WriteLock lock = LockForWriting();
+    return RecalculateLocked();
+}
+
+RecalculationStats Sheet::RecalculateLocked()
+{
+    const auto start = std::chrono::steady_clock::now();
+    RecalculationStats stats;
+    stats.recomputed_cells = graph_.Recalculate(GetPool());
+    stats.duration = std::chrono::steady_clock::now() - start;
+    return stats;
+}
+
+void Sheet::RecalculateIfAutomatic()
+{
+    if (recalculation_mode_ == RecalculationMode::Automatic)
+        RecalculateLocked();
+}
+
+size_t Sheet::GetCellCount() const
+{
+    return table_.Count();
+}
+
+FlatMapStats Sheet::GetCellStorageStats() const
+{
+    return table_.GetSparseStats();
+}
+
+FlatMapStats Sheet::GetGraphStats() const
+{
+    return graph_.GetStats();
+}
+
+size_t Sheet::GetSharedFormulaCount() const
+{
+    return formula_cache_.GetSharedCount();
+}
+
+uint64_t Sheet::GetVersion() const
+{
+    return version_;
+}
+
+std::shared_ptr<const SheetSnapshot> Sheet::Snapshot()
+{
+    const WriteLock lock = LockForWriting();
+    // shared cells stay evaluated: a cell copies its content before dropping the cached value
+    RecalculateLocked();
+    return std::shared_ptr<const SheetSnapshot>(new SheetSnapshot(table_.Share(), area_.GetSize(), version_));
+}
+
+Sheet::ReadLock Sheet::LockForReading() const
+{
+    return ReadLock(mutex_);
+}
+
+Sheet::WriteLock Sheet::LockForWriting()
+{
+    return WriteLock(mutex_);
+}
+
+std::string Sheet::ListCells(const std::vector<Position> &cells)
+{
+    constexpr size_t MAX_LISTED = 10;
+    std::string result;
+    for (size_t i = 0; i < cells.size() && i < MAX_LISTED; ++i)
+        result += (i ? ", " : "") + cells[i].ToString();
+    if (cells.size() > MAX_LISTED)
+        result += " and " + std::to_string(cells.size() - MAX_LISTED) + " more";
+    return result;
+}
+
+void Sheet::CheckCorrectness(const Position &pos)
+{
+    if (!pos.IsValid())
     {
-        for (int k = 0; k < size_.cols; ++k)
-        {
-            if (table_.count({i, k}))
-            {
-                output << table_.at({i, k}).GetText();
-            }
-            if (k != size_.cols - 1)
-            {
-                output << "\t";
-            }
-        }
-        output << "\n";
+        throw InvalidPositionException("Invalid position " + pos.ToString());
     }
 }
 
-void Sheet::CheckCorrectness(const Position &pos)
+SheetSnapshot::SheetSnapshot(TiledTable<Cell> table, Size size, uint64_t version)
+    : table_(std::move(table)), size_(size), version_(version)
+{
+}
+
+const CellInterface *SheetSnapshot::GetCell(Position pos) const
 {
     if (!pos.IsValid())
     {
         throw InvalidPositionException("Invalid position " + pos.ToString());
     }
+    return table_.Find(pos);
+}
+
+Size SheetSnapshot::GetPrintableSize() const
+{
+    return size_;
+}
+
+void SheetSnapshot::PrintValues(std::ostream &output) const
+{
+    PrintCells(table_, size_, output, [&output](const Cell &cell) { output << cell.GetValueView(); });
+}
+
+void SheetSnapshot::PrintTexts(std::ostream &output) const
+{
+    PrintCells(table_, size_, output, [&output](const Cell &cell) { output << cell.GetTextView(); });
+}
+
+uint64_t SheetSnapshot::GetVersion() const
+{
+    return version_;
 }
 
 std::unique_ptr<SheetInterface> CreateSheet()
@@ -138,3 +421,9 @@ std::ostream &operator<<(std::ostream &output, const CellInterface::Value &value
     std::visit([&](const auto &x) { output << x; }, value);
     return output;
 }
+
+std::ostream &operator<<(std::ostream &output, const CellInterface::ValueView &value)
+{
+    std::visit([&](const auto &x) { output << x; }, value);
+    return output;
+}
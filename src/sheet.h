@@ -2,23 +2,139 @@
 
 #include "cell.h"
 #include "common.h"
+#include "thread_pool.h"
+#include "tiled_table.h"
 
+#include <chrono>
+#include <cstdint>
 #include <functional>
-#include <unordered_map>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <utility>
+#include <vector>
 
+// Bounding rectangle of cells with non-empty text.
+// Keeps the number of such cells in every row and column,
+// so each update costs O(log N) instead of a scan over the table
+class PrintableArea
+{
+  public:
+    void Add(Position pos);
+
+    void Remove(Position pos);
+
+    Size GetSize() const;
+
+  private:
+    std::map<int, int> rows_;
+    std::map<int, int> cols_;
+
+    static void Decrement(std::map<int, int> &counters, int index);
+};
+
+// Lazy: formulas are evaluated when their values are requested.
+// Automatic: every change is followed by recalculation of all affected formulas
+enum class RecalculationMode
+{
+    Lazy,
+    Automatic,
+};
+
+struct RecalculationStats
+{
+    size_t recomputed_cells = 0;
+    std::chrono::nanoseconds duration{0};
+};
+
+// Immutable state of a sheet at one version, made by Sheet::Snapshot().
+// Cells are shared with the sheet, which copies a tile of cells before changing it. Every formula
+// of a snapshot is already evaluated, so reading needs no lock and never waits for the sheet,
+// from any number of threads
+class SheetSnapshot
+{
+  public:
+    const CellInterface *GetCell(Position pos) const;
+
+    Size GetPrintableSize() const;
+
+    void PrintValues(std::ostream &output) const;
+
+    void PrintTexts(std::ostream &output) const;
+
+    // Version of the sheet the snapshot was made at
+    uint64_t GetVersion() const;
+
+  private:
+    friend class Sheet;
+
+    SheetSnapshot(TiledTable<Cell> table, Size size, uint64_t version);
+
+    TiledTable<Cell> table_;
+    Size size_;
+    uint64_t version_;
+};
+
+class Sheet;
+
+// Cell of a sheet as the non-const Sheet::GetCell() returns it, valid as long as the sheet. Set() changes the
+// sheet the way SetCell() does, the other methods read the cell stored at the position, which reads as empty
+// once it is cleared
+class SheetCell : public CellInterface
+{
+  public:
+    SheetCell(Sheet &sheet, Position pos);
+
+    void Set(std::string text) override;
+
+    Value GetValue() const override;
+
+    ValueView GetValueView() const override;
+
+    std::string GetText() const override;
+
+    const std::vector<Position> &GetReferencedCells() const override;
+
+    std::optional<NumericValue> GetNumericValue() const override;
+
+  private:
+    Sheet &sheet_;
+    Position pos_;
+
+    const CellInterface &GetStored() const;
+};
+
+// Any number of threads may read a sheet at once: const methods, both GetCell overloads and values of cells.
+// Formula values computed by readers are cached atomically. Modifying methods take an exclusive
+// lock, so a reader running alongside writers holds LockForReading() while it uses the sheet
 class Sheet : public SheetInterface
 {
-    using Table = std::unordered_map<Position, Cell, Position::Hasher>;
+    using Table = TiledTable<Cell>;
 
   public:
+    using ReadLock = std::shared_lock<std::shared_mutex>;
+
     Sheet();
 
     ~Sheet() override;
 
     void SetCell(Position pos, std::string text) override;
 
+    // Sets all cells at once: texts are parsed first, in parallel, then the dependency graph is updated
+    // with one cycle check and dependants are invalidated once. Either every cell is set or none is.
+    // FormulaException lists every incorrect formula, CircularDependencyException every cell lying on
+    // a cycle. For a position given several times the last text is used
+    void SetCells(std::vector<std::pair<Position, std::string>> cells);
+
+    // Null for positions which were never set or were cleared. Positions referenced by formulas
+    // are nodes of the dependency graph only, they get cells when they are set.
+    // The cell keeps its address until it is cleared, views of its text stay valid until it is changed.
+    // After Snapshot() the next change of the sheet may copy the cell away from the snapshot: pointers
+    // and views taken before it then belong to the snapshot and are valid as long as the snapshot
     const CellInterface *GetCell(Position pos) const override;
 
+    // Same lookup, the cell is returned as a SheetCell: changing it changes the sheet
     CellInterface *GetCell(Position pos) override;
 
     void ClearCell(Position pos) override;
@@ -29,12 +145,76 @@ class Sheet : public SheetInterface
 
     void PrintTexts(std::ostream &output) const override;
 
+    // Number of threads used by SetCells and Recalculate, the calling thread included, 1 disables threads.
+    // Hardware concurrency by default, the threads are started on the first bulk operation
+    void SetThreadCount(size_t count);
+
+    size_t GetThreadCount() const;
+
+    void SetRecalculationMode(RecalculationMode mode);
+
+    RecalculationMode GetRecalculationMode() const;
+
+    // Evaluates formulas invalidated since the last recalculation, each one exactly once,
+    // referenced cells before the cells that depend on them. Formulas which do not depend
+    // on each other are evaluated on GetThreadCount() threads
+    RecalculationStats Recalculate();
+
+    // Number of stored cells, cells set to an empty text included
+    size_t GetCellCount() const;
+
+    // Collision and probe-length statistics of hash maps in sparse cell tiles
+    FlatMapStats GetCellStorageStats() const;
+
+    // Collision and probe-length statistics of the dependency graph
+    FlatMapStats GetGraphStats() const;
+
+    // Number of compiled formula bodies, formulas of the same shape share one
+    size_t GetSharedFormulaCount() const;
+
+    // Number of changes made to cells, every successful SetCell, SetCells or ClearCell changing anything counts once
+    uint64_t GetVersion() const;
+
+    // Evaluates formulas invalidated since the last recalculation and returns the current state.
+    // Costs a copy of the tile directory, tiles are copied later, on their first change
+    std::shared_ptr<const SheetSnapshot> Snapshot();
+
+    // Keeps writers out until released, other readers are not blocked. Not recursive: the thread
+    // holding it neither takes it again nor modifies the sheet, cells included
+    ReadLock LockForReading() const;
+
   private:
+    using WriteLock = std::unique_lock<std::shared_mutex>;
+
     Table table_;
-    Size size_;
+    PrintableArea area_;
     Graph graph_;
+    FormulaCache formula_cache_;
+    RecalculationMode recalculation_mode_ = RecalculationMode::Lazy;
+    size_t thread_count_ = ThreadPool::DefaultThreadCount();
+    std::unique_ptr<ThreadPool> pool_;
+    mutable std::shared_mutex mutex_;
+    uint64_t version_{0};
+    std::mutex sheet_cells_mutex_; // readers may make them concurrently
+    FlatPositionMap<std::unique_ptr<SheetCell>> sheet_cells_;
+
+    WriteLock LockForWriting();
+
+    RecalculationStats RecalculateLocked();
+
+    void RecalculateIfAutomatic();
+
+    // Null if bulk operations run on the calling thread
+    ThreadPool *GetPool();
+
+    CellContext GetContext(Position pos);
 
     static void CheckCorrectness(const Position &pos);
+
+    // Names of the first cells for exception messages
+    static std::string ListCells(const std::vector<Position> &cells);
 };
 
 std::ostream &operator<<(std::ostream &out, const CellInterface::Value &value);
+
+std::ostream &operator<<(std::ostream &out, const CellInterface::ValueView &value);
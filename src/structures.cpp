@@ -3,6 +3,7 @@
 #include <algorithm>
 #include <cctype>
 #include <sstream>
+#include <tuple>
 
 const int LETTERS = 26;
 const int MAX_POSITION_LENGTH = 17;
@@ -69,6 +70,44 @@ Position Position::FromString(std::string_view str)
     return {row - 1, col - 1};
 }
 
+Range Range::Between(Position lhs, Position rhs)
+{
+    return {{std::min(lhs.row, rhs.row), std::min(lhs.col, rhs.col)},
+            {std::max(lhs.row, rhs.row), std::max(lhs.col, rhs.col)}};
+}
+
+bool Range::operator==(Range rhs) const
+{
+    return first == rhs.first && last == rhs.last;
+}
+
+bool Range::operator<(Range rhs) const
+{
+    return std::tie(first, last) < std::tie(rhs.first, rhs.last);
+}
+
+bool Range::IsValid() const
+{
+    return first.IsValid() && last.IsValid() && first.row <= last.row && first.col <= last.col;
+}
+
+bool Range::Contains(Position pos) const
+{
+    return pos.row >= first.row && pos.row <= last.row && pos.col >= first.col && pos.col <= last.col;
+}
+
+size_t Range::CellCount() const
+{
+    return static_cast<size_t>(last.row - first.row + 1) * static_cast<size_t>(last.col - first.col + 1);
+}
+
+std::string Range::ToString() const
+{
+    if (!IsValid())
+        return {};
+    return first.ToString() + ':' + last.ToString();
+}
+
 Size::Size() = default;
 
 Size::Size(int rows, int cols) : rows(rows), cols(cols)
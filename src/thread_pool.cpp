@@ -0,0 +1,98 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(size_t thread_count)
+{
+    for (size_t i = 1; i < thread_count; ++i)
+        workers_.emplace_back([this] { WorkerLoop(); });
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    start_.notify_all();
+    for (auto &worker : workers_)
+        worker.join();
+}
+
+size_t ThreadPool::GetThreadCount() const
+{
+    return workers_.size() + 1;
+}
+
+void ThreadPool::ParallelFor(size_t count, size_t chunk, const std::function<void(size_t, size_t)> &func)
+{
+    if (count == 0)
+        return;
+    chunk = std::max<size_t>(chunk, 1);
+    if (workers_.empty() || count <= chunk)
+    {
+        func(0, count);
+        return;
+    }
+
+    {
+        std::lock_guard lock(mutex_);
+        func_ = &func;
+        count_ = count;
+        chunk_ = chunk;
+        next_ = 0;
+        active_ = workers_.size();
+        ++generation_;
+    }
+    start_.notify_all();
+    RunChunks();
+
+    std::unique_lock lock(mutex_);
+    done_.wait(lock, [this] { return active_ == 0; });
+    func_ = nullptr;
+    if (error_)
+        std::rethrow_exception(std::exchange(error_, nullptr));
+}
+
+size_t ThreadPool::DefaultThreadCount()
+{
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+void ThreadPool::WorkerLoop()
+{
+    size_t seen_generation{0};
+    std::unique_lock lock(mutex_);
+    while (true)
+    {
+        start_.wait(lock, [this, seen_generation] { return stop_ || generation_ != seen_generation; });
+        if (stop_)
+            return;
+        seen_generation = generation_;
+        lock.unlock();
+        RunChunks();
+        lock.lock();
+        if (--active_ == 0)
+            done_.notify_one();
+    }
+}
+
+void ThreadPool::RunChunks()
+{
+    while (true)
+    {
+        const size_t begin = next_.fetch_add(chunk_);
+        if (begin >= count_)
+            return;
+        try
+        {
+            (*func_)(begin, std::min(begin + chunk_, count_));
+        }
+        catch (...)
+        {
+            std::lock_guard lock(mutex_);
+            if (!error_)
+                error_ = std::current_exception();
+        }
+    }
+}
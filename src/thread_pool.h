@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Fixed set of threads running loops split into chunks.
+// Chunks are taken from a shared counter, so threads which are done with cheap chunks take
+// the remaining ones. The thread calling ParallelFor runs chunks too. Loops do not nest:
+// func must not call ParallelFor of the same pool
+class ThreadPool
+{
+  public:
+    // Starts thread_count - 1 workers
+    explicit ThreadPool(size_t thread_count);
+
+    ThreadPool(const ThreadPool &) = delete;
+
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    ~ThreadPool();
+
+    // Number of threads running chunks, the calling thread included
+    size_t GetThreadCount() const;
+
+    // Calls func(begin, end) for chunks of at most chunk indices covering [0, count) and waits for all
+    // of them. The first exception thrown by func is rethrown once every chunk is done
+    void ParallelFor(size_t count, size_t chunk, const std::function<void(size_t, size_t)> &func);
+
+    // Number of hardware threads, at least one
+    static size_t DefaultThreadCount();
+
+  private:
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable start_;
+    std::condition_variable done_;
+    bool stop_{false};
+    size_t generation_{0}; // number of loops started, workers wait for the next one
+    size_t active_{0};     // workers which have not finished the current loop
+
+    // the current loop
+    const std::function<void(size_t, size_t)> *func_{nullptr};
+    size_t count_{0};
+    size_t chunk_{1};
+    std::atomic<size_t> next_{0};
+    std::exception_ptr error_;
+
+    void WorkerLoop();
+
+    void RunChunks();
+};
+
+// ThreadPool::ParallelFor or, without a pool, a single call of func on the calling thread
+inline void ParallelFor(ThreadPool *pool, size_t count, size_t chunk, const std::function<void(size_t, size_t)> &func)
+{
+    if (pool)
+        pool->ParallelFor(count, chunk, func);
+    else if (count != 0)
+        func(0, count);
+}
@@ -0,0 +1,428 @@
+#pragma once
+
+#include "common.h"
+#include "flat_position_map.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+// Storage for values addressed by Position.
+// The grid is split into square tiles of TILE_SIZE x TILE_SIZE values, a tile is
+// allocated on the first write into it and released when its last value is erased.
+// Tiles are found through a two-level directory: a row of the directory is allocated
+// only when at least one tile in that row exists.
+// A tile keeps its first SPARSE_TILE_LIMIT values in a flat hash map and switches to a
+// dense index when it gets more, so sparse sheets do not pay for whole tiles. Either index
+// points into the slots of the tile, where a value stays until it is erased: inserting or
+// erasing other values never moves it. GetLayoutVersion() tells when pointers to values
+// may be stale.
+// Tables made by Share() keep the directory and tiles in common: a directory row or a tile
+// shared with another table is copied before the first change through Emplace(), Erase(),
+// FindMutable() or the non-const ForEach(), the values of the copy are new ones. Lookups never copy
+template <typename T> class TiledTable
+{
+  public:
+    static constexpr int TILE_SHIFT = 6;
+    static constexpr int TILE_SIZE = 1 << TILE_SHIFT;
+    static constexpr int TILE_MASK = TILE_SIZE - 1;
+    static constexpr int TILE_AREA = TILE_SIZE * TILE_SIZE;
+    static constexpr int DIRECTORY_ROWS = (Position::MAX_ROWS + TILE_SIZE - 1) / TILE_SIZE;
+    static constexpr int DIRECTORY_COLS = (Position::MAX_COLS + TILE_SIZE - 1) / TILE_SIZE;
+    static constexpr int SPARSE_TILE_LIMIT = TILE_AREA / 8;
+
+    TiledTable() = default;
+
+    TiledTable(TiledTable &&) noexcept = default;
+
+    TiledTable &operator=(TiledTable &&) noexcept = default;
+
+    // Table with the same values which shares every tile with this one, the cost is a copy of the directory
+    TiledTable Share() const
+    {
+        TiledTable result;
+        result.directory_ = directory_;
+        result.tile_count_ = tile_count_;
+        result.value_count_ = value_count_;
+        return result;
+    }
+
+    // Returns value stored at pos or nullptr. A lookup changes nothing, so it may run alongside other
+    // lookups. The value may belong to a tile shared with other tables, it is changed through FindMutable()
+    const T *Find(Position pos) const
+    {
+        const Tile *tile = FindTile(pos);
+        return tile ? FindInTile(*tile, pos) : nullptr;
+    }
+
+    // Same as Find(), but a tile shared with other tables is copied first, so the value may be changed
+    T *FindMutable(Position pos)
+    {
+        if (!FindTile(pos))
+            return nullptr;
+        return FindInTile(MutableTile(pos), pos);
+    }
+
+    bool Contains(Position pos) const
+    {
+        return Find(pos) != nullptr;
+    }
+
+    // Returns value stored at pos, default-constructs it first if there is none
+    T &Emplace(Position pos)
+    {
+        auto &row_ptr = directory_[pos.row >> TILE_SHIFT];
+        if (!row_ptr)
+            row_ptr = std::make_shared<DirectoryRow>();
+        DirectoryRow &row = Unshare(row_ptr);
+        auto &tile_ptr = row.tiles[pos.col >> TILE_SHIFT];
+        if (!tile_ptr)
+        {
+            tile_ptr = std::make_shared<Tile>();
+            ++row.tile_count;
+            ++tile_count_;
+        }
+        Tile &tile = Unshare(tile_ptr);
+        SlotIndex *slot = nullptr;
+        if (tile.dense)
+        {
+            slot = &(*tile.dense)[Offset(pos)];
+            if (*slot != NO_SLOT)
+                return tile.slots[*slot];
+        }
+        else
+        {
+            auto [index, created] = tile.sparse.TryEmplace(pos);
+            if (!created)
+                return tile.slots[*index];
+            slot = index;
+        }
+
+        *slot = tile.slots.Allocate();
+        T &value = tile.slots[*slot];
+        ++layout_version_;
+        ++value_count_;
+        if (++tile.value_count > SPARSE_TILE_LIMIT && !tile.dense)
+            MakeDense(tile);
+        return value;
+    }
+
+    // Returns false if there was nothing to erase
+    bool Erase(Position pos)
+    {
+        if (!Contains(pos))
+            return false;
+        auto &row_ptr = directory_[pos.row >> TILE_SHIFT];
+        DirectoryRow &row = Unshare(row_ptr);
+        auto &tile_ptr = row.tiles[pos.col >> TILE_SHIFT];
+        Tile &tile = Unshare(tile_ptr);
+        if (!tile.dense)
+        {
+            tile.slots.Release(*tile.sparse.Find(pos));
+            tile.sparse.Erase(pos);
+        }
+        else
+        {
+            SlotIndex &slot = (*tile.dense)[Offset(pos)];
+            tile.slots.Release(slot);
+            slot = NO_SLOT;
+        }
+
+        ++layout_version_;
+        --value_count_;
+        if (--tile.value_count == 0)
+        {
+            tile_ptr.reset();
+            --tile_count_;
+            if (--row.tile_count == 0)
+                row_ptr.reset();
+        }
+        return true;
+    }
+
+    // Changes on every insertion and erasure and whenever shared tiles are copied. Pointers to values,
+    // and the absence of a value at a position, stay valid while the version is the same
+    uint64_t GetLayoutVersion() const
+    {
+        return layout_version_;
+    }
+
+    size_t Count() const
+    {
+        return value_count_;
+    }
+
+    size_t TileCount() const
+    {
+        return tile_count_;
+    }
+
+    size_t DenseTileCount() const
+    {
+        size_t result{0};
+        ForEachTile([&result](int, int, const Tile &tile) { result += tile.dense ? 1 : 0; });
+        return result;
+    }
+
+    // Memory occupied by the directory and allocated tiles, shared ones included
+    size_t AllocatedBytes() const
+    {
+        size_t result{sizeof(*this)};
+        for (const auto &row : directory_)
+            result += row ? sizeof(DirectoryRow) : 0;
+        ForEachTile([&result](int, int, const Tile &tile) {
+            result += sizeof(Tile) + (tile.dense ? sizeof(DenseIndex) : tile.sparse.AllocatedBytes()) +
+                      tile.slots.AllocatedBytes();
+        });
+        return result;
+    }
+
+    // Collision and probe-length statistics of all sparse tiles
+    FlatMapStats GetSparseStats() const
+    {
+        FlatMapStats result;
+        ForEachTile([&result](int, int, const Tile &tile) { result += tile.sparse.GetStats(); });
+        return result;
+    }
+
+    // Calls func(Position, T &) for every stored value, tile by tile.
+    // Values of a dense tile are visited in row-major order, order inside a sparse tile is unspecified
+    template <typename Func> void ForEach(Func func)
+    {
+        for (auto &row_ptr : directory_)
+        {
+            if (!row_ptr)
+                continue;
+            for (auto &tile_ptr : Unshare(row_ptr).tiles)
+            {
+                if (tile_ptr)
+                    Unshare(tile_ptr);
+            }
+        }
+        ForEachImpl(*this, func);
+    }
+
+    template <typename Func> void ForEach(Func func) const
+    {
+        ForEachImpl(*this, func);
+    }
+
+  private:
+    using SlotIndex = uint16_t;
+
+    static constexpr SlotIndex NO_SLOT = UINT16_MAX;
+
+    using DenseIndex = std::array<SlotIndex, TILE_AREA>;
+
+    // Values of one tile, each one in a slot of its own. Chunks hold 2, 2, 4, 8, ... slots, so growing
+    // doubles the capacity by allocating a chunk instead of moving values, and a full tile fills all of
+    // them exactly. Slots of erased values are reused
+    class Slots
+    {
+      public:
+        Slots() = default;
+
+        Slots(const Slots &other) : free_(other.free_), size_(other.size_)
+        {
+            chunks_.reserve(other.chunks_.size());
+            for (size_t chunk = 0; chunk < other.chunks_.size(); ++chunk)
+            {
+                const size_t length = ChunkLength(chunk);
+                chunks_.push_back(std::make_unique<T[]>(length));
+                std::copy(other.chunks_[chunk].get(), other.chunks_[chunk].get() + length, chunks_.back().get());
+            }
+        }
+
+        T &operator[](SlotIndex slot)
+        {
+            // slots 0 and 1 lie in chunk 0, chunk k > 0 starts at slot 2^k
+            const int chunk = HighestBit(uint32_t{slot} | 1);
+            return chunks_[chunk][slot - ((uint32_t{1} << chunk) & ~uint32_t{1})];
+        }
+
+        const T &operator[](SlotIndex slot) const
+        {
+            return const_cast<Slots &>(*this)[slot];
+        }
+
+        // A free slot holding a default-constructed value
+        SlotIndex Allocate()
+        {
+            if (!free_.empty())
+            {
+                const SlotIndex slot = free_.back();
+                free_.pop_back();
+                return slot;
+            }
+            if (size_ == Capacity())
+                chunks_.push_back(std::make_unique<T[]>(ChunkLength(chunks_.size())));
+            return size_++;
+        }
+
+        void Release(SlotIndex slot)
+        {
+            (*this)[slot] = T();
+            free_.push_back(slot);
+        }
+
+        size_t AllocatedBytes() const
+        {
+            return Capacity() * sizeof(T) + chunks_.capacity() * sizeof(chunks_[0]) +
+                   free_.capacity() * sizeof(SlotIndex);
+        }
+
+      private:
+        std::vector<std::unique_ptr<T[]>> chunks_;
+        std::vector<SlotIndex> free_;
+        SlotIndex size_{0}; // slots handed out, free ones included
+
+        static size_t ChunkLength(size_t chunk)
+        {
+            return chunk ? size_t{1} << chunk : 2;
+        }
+
+        size_t Capacity() const
+        {
+            return chunks_.empty() ? 0 : size_t{1} << chunks_.size();
+        }
+
+        static int HighestBit(uint32_t value)
+        {
+#if defined(__GNUC__)
+            return 31 - __builtin_clz(value);
+#else
+            int result{0};
+            while (value >>= 1)
+                ++result;
+            return result;
+#endif
+        }
+    };
+
+    struct Tile
+    {
+        Tile() = default;
+
+        Tile(const Tile &other)
+            : dense(other.dense ? std::make_unique<DenseIndex>(*other.dense) : nullptr), sparse(other.sparse),
+              slots(other.slots), value_count(other.value_count)
+        {
+        }
+
+        std::unique_ptr<DenseIndex> dense; // null while the tile is sparse
+        FlatPositionMap<SlotIndex> sparse;
+        Slots slots;
+        int value_count{0};
+    };
+
+    struct DirectoryRow
+    {
+        std::array<std::shared_ptr<Tile>, DIRECTORY_COLS> tiles{}; // may be shared with other tables
+        int tile_count{0};
+    };
+
+    std::array<std::shared_ptr<DirectoryRow>, DIRECTORY_ROWS> directory_{}; // rows may be shared with other tables
+    size_t tile_count_{0};
+    size_t value_count_{0};
+    uint64_t layout_version_{0};
+
+    static int Offset(Position pos)
+    {
+        return ((pos.row & TILE_MASK) << TILE_SHIFT) | (pos.col & TILE_MASK);
+    }
+
+    const Tile *FindTile(Position pos) const
+    {
+        const auto &row = directory_[pos.row >> TILE_SHIFT];
+        if (!row)
+            return nullptr;
+        return row->tiles[pos.col >> TILE_SHIFT].get();
+    }
+
+    // The tile containing pos, which exists, copied together with its row if they are shared
+    Tile &MutableTile(Position pos)
+    {
+        DirectoryRow &row = Unshare(directory_[pos.row >> TILE_SHIFT]);
+        return Unshare(row.tiles[pos.col >> TILE_SHIFT]);
+    }
+
+    // A table is changed by one thread at a time, and tables sharing its nodes may only release them
+    // concurrently. A count of one is then final, the fence orders their last reads before the writes
+    template <typename Node> Node &Unshare(std::shared_ptr<Node> &node)
+    {
+        if (node.use_count() > 1)
+        {
+            node = std::make_shared<Node>(*node);
+            ++layout_version_;
+        }
+        else
+            std::atomic_thread_fence(std::memory_order_acquire);
+        return *node;
+    }
+
+    template <typename TileRef> static auto FindInTile(TileRef &tile, Position pos) -> decltype(&tile.slots[0])
+    {
+        if (!tile.dense)
+        {
+            const SlotIndex *slot = tile.sparse.Find(pos);
+            return slot ? &tile.slots[*slot] : nullptr;
+        }
+        const SlotIndex slot = (*tile.dense)[Offset(pos)];
+        return slot != NO_SLOT ? &tile.slots[slot] : nullptr;
+    }
+
+    // Only the index changes, values stay in their slots
+    static void MakeDense(Tile &tile)
+    {
+        tile.dense = std::make_unique<DenseIndex>();
+        tile.dense->fill(NO_SLOT);
+        tile.sparse.ForEach([&tile](Position pos, SlotIndex slot) { (*tile.dense)[Offset(pos)] = slot; });
+        tile.sparse.Clear();
+    }
+
+    // Calls func(tile_row, tile_col, tile) for every allocated tile
+    template <typename Func> void ForEachTile(Func func) const
+    {
+        for (int tile_row = 0; tile_row < DIRECTORY_ROWS; ++tile_row)
+        {
+            const auto &row = directory_[tile_row];
+            if (!row)
+                continue;
+            for (int tile_col = 0; tile_col < DIRECTORY_COLS; ++tile_col)
+            {
+                if (const auto &tile = row->tiles[tile_col])
+                    func(tile_row, tile_col, *tile);
+            }
+        }
+    }
+
+    template <typename Self, typename Func> static void ForEachImpl(Self &self, Func &func)
+    {
+        using Ref = std::conditional_t<std::is_const_v<Self>, const T &, T &>;
+        self.ForEachTile([&func](int tile_row, int tile_col, const Tile &tile) {
+            // slots are owned by the tile, constness follows the table
+            auto &slots = const_cast<Slots &>(tile.slots);
+            if (!tile.dense)
+            {
+                tile.sparse.ForEach(
+                    [&func, &slots](Position pos, SlotIndex slot) { func(pos, static_cast<Ref>(slots[slot])); });
+                return;
+            }
+            const SlotIndex *slot = tile.dense->data();
+            for (int r = 0; r < TILE_SIZE; ++r)
+            {
+                for (int c = 0; c < TILE_SIZE; ++c, ++slot)
+                {
+                    if (*slot != NO_SLOT)
+                        func(Position{(tile_row << TILE_SHIFT) | r, (tile_col << TILE_SHIFT) | c},
+                             static_cast<Ref>(slots[*slot]));
+                }
+            }
+        });
+    }
+};
@@ -1,7 +1,17 @@
 #include "../src/common.h"
+#include "../src/flat_position_map.h"
 #include "../src/formula.h"
+#include "../src/sheet.h"
+#include "../src/tiled_table.h"
 #include "test_runner_p.h"
 
+#include <algorithm>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <tuple>
+
 inline std::ostream &operator<<(std::ostream &output, Position pos)
 {
     return output << "(" << pos.row << ", " << pos.col << ")";
@@ -23,13 +33,14 @@ inline std::ostream &operator<<(std::ostream &output, const CellInterface::Value
     return output;
 }
 
-namespace
-{
-std::string ToString(FormulaError::Category category)
+inline std::ostream &operator<<(std::ostream &output, const FormulaInterface::Value &value)
 {
-    return std::string(FormulaError(category).ToString());
+    std::visit([&](const auto &x) { output << x; }, value);
+    return output;
 }
 
+namespace
+{
 void TestPositionAndStringConversion()
 {
     auto testSingle = [](Position pos, std::string_view str) {
@@ -210,6 +221,45 @@ void TestFormulaReferencedCells()
     ASSERT_EQUAL(tricky->GetReferencedCells(), (std::vector{"A1"_pos, "A2"_pos, "A3"_pos}));
 }
 
+void TestFormulaReferencesSorted()
+{
+    // cells and ranges are sorted and deduplicated once, at parse time, the ranges are not listed as cells
+    auto formula = ParseFormula("A10 + SUM(B1:B3, A1:A2) + C1*A2 + MAX(A2:A1, B3:B1) + A10 + C1");
+    ASSERT_EQUAL(formula->GetReferencedCells(), (std::vector{"C1"_pos, "A2"_pos, "A10"_pos}));
+    ASSERT(formula->GetReferencedRanges() ==
+           (std::vector{Range::Between("A1"_pos, "A2"_pos), Range::Between("B1"_pos, "B3"_pos)}));
+    ASSERT_EQUAL(&formula->GetReferencedCells(), &formula->GetReferencedCells());
+
+    // a cell lends the same lists
+    Sheet sheet;
+    sheet.SetCell("D1"_pos, "=" + formula->GetExpression());
+    const auto *cell = static_cast<const Cell *>(std::as_const(sheet).GetCell("D1"_pos));
+    ASSERT_EQUAL(cell->GetReferencedCells(), formula->GetReferencedCells());
+    ASSERT(cell->GetReferencedRanges() == formula->GetReferencedRanges());
+}
+
+void TestFormulaCanonicalText()
+{
+    // the canonical text is printed once, at parse time, and again only when the cell is reparsed
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=( ( 1 ) ) + 2*(3)");
+    const auto *cell = static_cast<const Cell *>(std::as_const(sheet).GetCell("A1"_pos));
+    ASSERT_EQUAL(cell->GetText(), "=1+2*3");
+    const char *cached = cell->GetTextView().data();
+    ASSERT_EQUAL(cell->GetTextView().data(), cached);
+
+    sheet.SetCell("A1"_pos, "=1+2*3");
+    ASSERT_EQUAL(cell->GetTextView().data(), cached);
+
+    sheet.SetCell("A1"_pos, "= (1+2) * 3");
+    ASSERT_EQUAL(cell->GetTextView(), "=(1+2)*3");
+    ASSERT_EQUAL(cell->GetText(), "=(1+2)*3");
+    ASSERT_EQUAL(cell->GetValue(), CellInterface::Value(9.0));
+    std::ostringstream texts;
+    sheet.PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), "=(1+2)*3\n");
+}
+
 void TestErrorValue()
 {
     auto sheet = CreateSheet();
@@ -306,6 +356,51 @@ void TestPrint()
     ASSERT_EQUAL(values.str(), "\t\nmeow\t35\n");
 }
 
+void TestValueView()
+{
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "a text long enough not to fit into a small string");
+    sheet->SetCell("A2"_pos, "'=escaped");
+    sheet->SetCell("A3"_pos, "=A4+1");
+    sheet->SetCell("A5"_pos, "=1/0");
+
+    using View = CellInterface::ValueView;
+    const CellInterface *text = sheet->GetCell("A1"_pos);
+    ASSERT(text->GetValueView() == View(std::string_view("a text long enough not to fit into a small string")));
+    ASSERT_EQUAL(std::get<std::string_view>(text->GetValueView()).data(),
+                 std::get<std::string_view>(text->GetValueView()).data());
+    ASSERT(sheet->GetCell("A2"_pos)->GetValueView() == View(std::string_view("=escaped")));
+    ASSERT(sheet->GetCell("A3"_pos)->GetValueView() == View(1.0));
+    ASSERT(sheet->GetCell("A4"_pos) == nullptr);
+    ASSERT(sheet->GetCell("A5"_pos)->GetValueView() == View(FormulaError::Category::Div0));
+
+    std::ostringstream values;
+    sheet->PrintValues(values);
+    ASSERT_EQUAL(values.str(), "a text long enough not to fit into a small string\n=escaped\n1\n\n#DIV/0!\n");
+}
+
+void TestPrintableSizeTracking()
+{
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("C3"_pos, "=A1");
+    sheet->SetCell("B5"_pos, "text");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{5, 3}));
+
+    // cells without text do not extend the printable area
+    sheet->SetCell("D1"_pos, "=Z100");
+    sheet->SetCell("E7"_pos, "");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{5, 4}));
+
+    sheet->ClearCell("B5"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{3, 4}));
+    sheet->SetCell("D1"_pos, "");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{3, 3}));
+    sheet->ClearCell("C3"_pos);
+    sheet->ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+}
+
 void TestCellReferences()
 {
     auto sheet = CreateSheet();
@@ -319,7 +414,7 @@ void TestCellReferences()
 
     // Ссылка на пустую ячейку
     sheet->SetCell("B2"_pos, "=B1");
-    ASSERT(sheet->GetCell("B1"_pos)->GetReferencedCells().empty());
+    ASSERT(sheet->GetCell("B1"_pos) == nullptr);
     ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(), std::vector{"B1"_pos});
 
     sheet->SetCell("A2"_pos, "");
@@ -373,6 +468,1092 @@ void TestCellCircularReferences()
     ASSERT(caught);
     ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
 }
+
+void TestCircularReferencesAfterReordering()
+{
+    auto sheet = CreateSheet();
+    // the chain is built against the order in which cells appear, so every edit reorders cells
+    for (int row = 0; row < 50; ++row)
+        sheet->SetCell(Position{row, 0}, "=" + Position{row + 1, 0}.ToString() + "+1");
+    sheet->SetCell("B1"_pos, "=A1+A25");
+
+    auto is_rejected = [&sheet](Position pos, const std::string &text) {
+        try
+        {
+            sheet->SetCell(pos, text);
+        }
+        catch (const CircularDependencyException &)
+        {
+            return true;
+        }
+        return false;
+    };
+    ASSERT(is_rejected("A51"_pos, "=A1"));
+    ASSERT(is_rejected("A51"_pos, "=C1+B1"));
+    ASSERT(is_rejected("A30"_pos, "=A20"));
+    ASSERT(is_rejected("A10"_pos, "=A10"));
+
+    // a rejected edit keeps the old dependencies
+    sheet->SetCell("A51"_pos, "1");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(51.0));
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(78.0));
+    ASSERT_EQUAL(sheet->GetCell("A10"_pos)->GetText(), "=A11+1");
+
+    // dependencies which agree with the order after removal of the chain link
+    sheet->SetCell("A30"_pos, "5");
+    ASSERT(!is_rejected("A51"_pos, "=A1+A29"));
+    ASSERT(!is_rejected("A31"_pos, "=A51"));
+    ASSERT(is_rejected("A29"_pos, "=A51"));
+    ASSERT_EQUAL(sheet->GetCell("A51"_pos)->GetValue(), CellInterface::Value(40.0));
+}
+
+void TestDeepChainEvaluation()
+{
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    for (int row = 1; row < Position::MAX_ROWS; ++row)
+        sheet->SetCell(Position{row, 0}, "=" + Position{row - 1, 0}.ToString() + "+1");
+    const Position last{Position::MAX_ROWS - 1, 0};
+    ASSERT_EQUAL(sheet->GetCell(last)->GetValue(), CellInterface::Value(double(Position::MAX_ROWS)));
+
+    sheet->SetCell("A1"_pos, "=B1");
+    sheet->SetCell("B1"_pos, "=1/0");
+    ASSERT_EQUAL(sheet->GetCell(last)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+}
+
+void TestRangeFunctions()
+{
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("A2"_pos, "=A1*4");
+    sheet->SetCell("A4"_pos, "-2.5");
+    sheet->SetCell("B1"_pos, "text");
+    sheet->SetCell("B2"_pos, "=1/0");
+    for (int row = 0; row < 1000; ++row)
+        sheet->SetCell(Position{row, 3}, std::to_string(row % 10));
+
+    auto value = [&sheet](const std::string &expression) {
+        sheet->SetCell("Z1"_pos, "=" + expression);
+        return sheet->GetCell("Z1"_pos)->GetValue();
+    };
+    using Value = CellInterface::Value;
+    ASSERT_EQUAL(value("SUM(A1:A4)"), Value(2.5));
+    ASSERT_EQUAL(value("SUM(A4:A1)"), Value(2.5));
+    ASSERT_EQUAL(value("AVERAGE(A1:A4)"), Value(2.5 / 3));
+    ASSERT_EQUAL(value("MIN(A1:A4)"), Value(-2.5));
+    ASSERT_EQUAL(value("MAX(A1:A4,10)"), Value(10.0));
+    ASSERT_EQUAL(value("COUNT(A1:B4)"), Value(3.0));
+    ASSERT_EQUAL(value("SUM(D1:D1000)"), Value(4500.0));
+    ASSERT_EQUAL(value("MAX(D1:D1000)-MIN(D1:D1000)"), Value(9.0));
+    ASSERT_EQUAL(value("SUM(A1,A2)*COUNT(D1:D1000,1)"), Value(5005.0));
+    ASSERT_EQUAL(value("MIN(C1:C10)"), Value(0.0));
+    ASSERT_EQUAL(value("AVERAGE(C1:C10)"), Value(FormulaError::Category::Div0));
+    ASSERT_EQUAL(value("SUM(A1:B1)"), Value(FormulaError::Category::Value));
+    ASSERT_EQUAL(value("MAX(A2:B2)"), Value(FormulaError::Category::Div0));
+
+    ASSERT_EQUAL(ParseFormula("SUM( B10:A1 , 2*(C1) )")->GetExpression(), "SUM(A1:B10,2*C1)");
+    auto formula = ParseFormula("SUM(A1:B10)+MAX(C1:C3,A1:B10)+D4");
+    ASSERT_EQUAL(formula->GetReferencedCells(), (std::vector{"D4"_pos}));
+    ASSERT_EQUAL(formula->GetReferencedRanges().size(), 2u);
+    for (std::string incorrect :
+         {"A1:B2", "SUM()", "SUM(A1:B2", "SUMM(A1)", "SUM(A1:)", "SUM(A1:B2+1)", "SUM(A1:ZZZZ1)", "SUM A1"})
+    {
+        bool caught = false;
+        try
+        {
+            ParseFormula(incorrect);
+        }
+        catch (const FormulaException &)
+        {
+            caught = true;
+        }
+        ASSERT(caught);
+    }
+
+    // a change inside a range invalidates the formula, a cycle through a range is rejected
+    sheet->SetCell("E1"_pos, "=SUM(D1:D1000)");
+    ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), Value(4500.0));
+    sheet->SetCell("D500"_pos, "1000");
+    ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), Value(5491.0));
+    sheet->SetCell("E2"_pos, "=E1*2");
+    bool caught = false;
+    try
+    {
+        sheet->SetCell("D700"_pos, "=E2");
+    }
+    catch (const CircularDependencyException &)
+    {
+        caught = true;
+    }
+    ASSERT(caught);
+    caught = false;
+    try
+    {
+        sheet->SetCell("D1"_pos, "=SUM(D1:D2)");
+    }
+    catch (const CircularDependencyException &)
+    {
+        caught = true;
+    }
+    ASSERT(caught);
+    sheet->SetCell("D700"_pos, "=A2+1");
+    ASSERT_EQUAL(sheet->GetCell("E2"_pos)->GetValue(), Value(10974.0));
+}
+
+void TestNumericTextValues()
+{
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, " 12.5");
+    sheet->SetCell("A2"_pos, "'1e3");
+    sheet->SetCell("A3"_pos, "'");
+    sheet->SetCell("A4"_pos, "3D");
+    sheet->SetCell("A5"_pos, "=A1*2");
+
+    using Numeric = std::optional<NumericValue>;
+    auto numeric = [&sheet](Position pos) { return sheet->GetCell(pos)->GetNumericValue(); };
+    ASSERT(numeric("A1"_pos) == Numeric(12.5));
+    ASSERT(numeric("A2"_pos) == Numeric(1000.0));
+    ASSERT(numeric("A3"_pos) == std::nullopt);
+    ASSERT(numeric("A4"_pos) == Numeric(FormulaError::Category::Value));
+    ASSERT(numeric("A5"_pos) == Numeric(25.0));
+
+    // escaped empty text is zero in expressions and is skipped by functions
+    sheet->SetCell("B1"_pos, "=A2+A3");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(1000.0));
+    sheet->SetCell("B2"_pos, "=COUNT(A1:A5)");
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(), CellInterface::Value(3.0));
+    sheet->SetCell("A4"_pos, "4");
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(), CellInterface::Value(4.0));
+}
+
+void TestSharedFormulas()
+{
+    Sheet sheet;
+    for (int row = 0; row < 100; ++row)
+    {
+        const std::string name = std::to_string(row + 1);
+        sheet.SetCell({row, 0}, std::to_string(row));
+        sheet.SetCell({row, 1}, "2");
+        sheet.SetCell({row, 2}, row % 2 ? "=A" + name + " * B" + name : "=A" + name + "*B" + name);
+        sheet.SetCell({row, 3}, "=SUM(A" + name + ":C" + name + ")");
+    }
+    ASSERT_EQUAL(sheet.GetSharedFormulaCount(), 2u);
+    ASSERT_EQUAL(sheet.GetCell("C8"_pos)->GetText(), "=A8*B8");
+    ASSERT_EQUAL(sheet.GetCell("C8"_pos)->GetValue(), CellInterface::Value(14.0));
+    ASSERT_EQUAL(sheet.GetCell("C8"_pos)->GetReferencedCells(), (std::vector{"A8"_pos, "B8"_pos}));
+    ASSERT_EQUAL(sheet.GetCell("D100"_pos)->GetText(), "=SUM(A100:C100)");
+    ASSERT_EQUAL(sheet.GetCell("D100"_pos)->GetValue(), CellInterface::Value(99.0 + 2 + 198));
+
+    // a shared formula is updated through its own references only
+    sheet.SetCell("A8"_pos, "10");
+    ASSERT_EQUAL(sheet.GetCell("C8"_pos)->GetValue(), CellInterface::Value(20.0));
+    ASSERT_EQUAL(sheet.GetCell("C9"_pos)->GetValue(), CellInterface::Value(16.0));
+
+    // invalid references are not written relatively, so such formulas are never shared
+    sheet.SetCell("E1"_pos, "=A16384");
+    for (int attempt = 0; attempt < 2; ++attempt)
+    {
+        bool caught = false;
+        try
+        {
+            sheet.SetCell("E2"_pos, "=A16385");
+        }
+        catch (const FormulaException &)
+        {
+            caught = true;
+        }
+        ASSERT(caught);
+    }
+    ASSERT_EQUAL(sheet.GetSharedFormulaCount(), 3u);
+
+    for (int row = 0; row < 100; ++row)
+        sheet.ClearCell({row, 2});
+    ASSERT_EQUAL(sheet.GetSharedFormulaCount(), 2u);
+}
+
+void TestBytecodeMatchesTreeWalker()
+{
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "2");
+    sheet->SetCell("A2"_pos, "=A1*3");
+    sheet->SetCell("B1"_pos, "text");
+    sheet->SetCell("B2"_pos, "=1/0");
+
+    auto run = [&](const FormulaAST &ast, bool tree) { return tree ? ast.ExecuteTree(*sheet) : ast.Execute(*sheet); };
+
+    for (std::string expression :
+         {"1", "-A1", "+-+A2", "A1+A2*3-(A1-A2)/4", "-(A1+A2)*-(A2-A1)", "A1*A1*A1/A2+C7", "A1+B1", "B2*0",
+          "SUM(A1:A3,A1*2)+MAX(A2:A1)", "COUNT(A1:B3)", "AVERAGE(C1:C5)", "MIN(A1,A2,SUM(A1:A2))", "SUM(A1:B1)",
+          "SUM(B1:B2,1/0)", "B1/0", "(A1-A1)/(A1-A1)", "-B2+B1",
+          "(((((((((((((((((((((((((((((((((((((((((((((((((((((((((((((((((((((1+A1)+A1)+A1)+A1)+A1)+A1)+A1)"
+          "+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)"
+          "+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)"
+          "+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)+A1)"})
+    {
+        auto ast = ParseFormulaAST(expression);
+        ASSERT_EQUAL(run(ast, false), run(ast, true));
+    }
+
+    std::string right_deep = "1";
+    for (int i = 0; i < 100; ++i)
+    {
+        right_deep = "A1-(" + right_deep + ")";
+    }
+    auto ast = ParseFormulaAST(right_deep);
+    ASSERT_EQUAL(run(ast, false), run(ast, true));
+}
+
+void TestHandWrittenParserMatchesAntlr()
+{
+    // structure of the tree and order of cells or the fact of an error
+    auto parse = [](const std::string &expression, FormulaParserMode mode) -> std::string {
+        try
+        {
+            auto ast = ParseFormulaAST(expression, mode);
+            std::ostringstream out;
+            ast.Print(out);
+            out << " | ";
+            ast.PrintFormula(out);
+            out << " | ";
+            ast.PrintCells(out);
+            return out.str();
+        }
+        catch (const FormulaException &)
+        {
+            return "FormulaException";
+        }
+    };
+    auto check = [&](const std::string &expression) {
+        ASSERT_EQUAL(parse(expression, FormulaParserMode::HandWritten), parse(expression, FormulaParserMode::Antlr));
+    };
+
+    for (std::string expression :
+         {"1", "  -1  ", "2 + 2*2", "(12+13) * (14+(13-24/(1+1))*55-46)", "-2*3", "2*-3", "--+-1", "1-2-3", "8/4/2",
+          "-(A1+B2)*C3/+D4", "A1 + A2 + A1", ".5", "1.5e-3", "1E+5", "12e3.4", "1e400", "1e-400", "", "(", "()",
+          "((1)", "1)", "2+4-", "A0++", "A2B", "3X", "1.", "1e", "1.5E+", "A1E5", "1 2", "X0", "ABCD1", "A123456",
+          "XFD16384", "XFD16385", "a1", "1 % 2", "\t1\r\n+\n2"})
+    {
+        check(expression);
+    }
+
+    std::mt19937 generator(1);
+    const std::vector<std::string> tokens{"1", "23", ".5", "4e2", "A1", "B12", "ZZ9", "+", "-", "*", "/", "(", ")", " "};
+    std::uniform_int_distribution<size_t> token(0, tokens.size() - 1), length(1, 12);
+    for (int i = 0; i < 2000; ++i)
+    {
+        std::string expression;
+        for (size_t k = length(generator); k > 0; --k)
+        {
+            expression += tokens[token(generator)];
+        }
+        check(expression);
+    }
+}
+
+void TestRecalculation()
+{
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("A2"_pos, "=A1*10");
+    sheet.SetCell("A3"_pos, "=A2+A1");
+    sheet.SetCell("B1"_pos, "=A3/2");
+    ASSERT_EQUAL(sheet.Recalculate().recomputed_cells, 3u);
+    ASSERT_EQUAL(sheet.Recalculate().recomputed_cells, 0u);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(11.0));
+
+    // a text input invalidates the whole chain above it
+    sheet.SetCell("A1"_pos, "4");
+    ASSERT_EQUAL(sheet.Recalculate().recomputed_cells, 3u);
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(44.0));
+
+    // values read in lazy mode are not evaluated again
+    sheet.SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(11.0));
+    ASSERT_EQUAL(sheet.Recalculate().recomputed_cells, 1u);
+
+    sheet.SetRecalculationMode(RecalculationMode::Automatic);
+    sheet.SetCell("A2"_pos, "=A1*100");
+    ASSERT_EQUAL(sheet.Recalculate().recomputed_cells, 0u);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(50.5));
+    sheet.ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet.Recalculate().recomputed_cells, 0u);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(0.0));
+}
+
+void TestSetCells()
+{
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("X1"_pos, "=Y1");
+    // every formula refers to a cell set later in the batch
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 1; row < 20; ++row)
+        cells.emplace_back(Position{row, 0}, "=" + Position{row - 1, 0}.ToString() + "+1");
+    std::reverse(cells.begin(), cells.end());
+    cells.emplace_back("A1"_pos, "5");
+    cells.emplace_back("B1"_pos, "=SUM(A1:A20)");
+    cells.emplace_back("A1"_pos, "10");
+    sheet.SetCells(cells);
+    ASSERT_EQUAL(sheet.GetCell("A20"_pos)->GetValue(), CellInterface::Value(29.0));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(390.0));
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{20, 24}));
+
+    auto rejected_cells = [&sheet](std::vector<std::pair<Position, std::string>> cells) {
+        try
+        {
+            sheet.SetCells(std::move(cells));
+        }
+        catch (const CircularDependencyException &e)
+        {
+            return e.GetCells();
+        }
+        return std::vector<Position>{};
+    };
+    // every cell on a cycle is reported, a cell only depending on one is not
+    std::vector<Position> cyclic{"B2"_pos, "C1"_pos, "D1"_pos, "E1"_pos, "F1"_pos, "X1"_pos, "Y1"_pos};
+    for (int row = 0; row < 10; ++row)
+        cyclic.push_back(Position{row, 0});
+    std::sort(cyclic.begin(), cyclic.end());
+    ASSERT_EQUAL(rejected_cells({{"C1"_pos, "=D1"},
+                                 {"D1"_pos, "=E1"},
+                                 {"E1"_pos, "=C1"},
+                                 {"F1"_pos, "=F1+A1"},
+                                 {"G1"_pos, "=C1"},
+                                 {"A1"_pos, "=A10"},
+                                 {"Y1"_pos, "=X1"},
+                                 {"B2"_pos, "=SUM(B1:B3)"}}),
+                 cyclic);
+    ASSERT_EQUAL(rejected_cells({{"B2"_pos, "=SUM(B1:B3)"}}), std::vector<Position>{"B2"_pos});
+
+    // a rejected batch changes nothing
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "10");
+    ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("A20"_pos)->GetValue(), CellInterface::Value(29.0));
+    bool caught = false;
+    try
+    {
+        sheet.SetCells({{"C1"_pos, "1"}, {"C2"_pos, "=1+"}});
+    }
+    catch (const FormulaException &)
+    {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+
+    // cells of a range on a cycle are on the cycle too
+    cyclic = {"B1"_pos};
+    for (int row = 0; row < 20; ++row)
+        cyclic.push_back(Position{row, 0});
+    std::sort(cyclic.begin(), cyclic.end());
+    ASSERT_EQUAL(rejected_cells({{"A1"_pos, "=B1"}}), cyclic);
+
+    // the order of cells is kept for single edits after a batch
+    sheet.SetCells({{"A1"_pos, "=C1"}, {"C1"_pos, "=Y1+2"}, {"Y1"_pos, "3"}});
+    sheet.SetCell("Y1"_pos, "=X2");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(230.0));
+    bool single_caught = false;
+    try
+    {
+        sheet.SetCell("X2"_pos, "=A5");
+    }
+    catch (const CircularDependencyException &)
+    {
+        single_caught = true;
+    }
+    ASSERT(single_caught);
+    sheet.Recalculate();
+    sheet.SetCells({{"X2"_pos, "1"}});
+    ASSERT_EQUAL(sheet.Recalculate().recomputed_cells, 24u);
+    ASSERT_EQUAL(sheet.GetCell("A20"_pos)->GetValue(), CellInterface::Value(22.0));
+}
+
+void TestParallelSetCells()
+{
+    // filled-down shapes, unique formulas and texts, enough of them to be split between threads
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < 2000; ++row)
+    {
+        const std::string name = std::to_string(row + 1);
+        cells.emplace_back(Position{row, 0}, std::to_string(row % 17));
+        cells.emplace_back(Position{row, 1}, "=A" + name + "*2+" + std::to_string(row % 5));
+        cells.emplace_back(Position{row, 2}, "=SUM(A" + name + ":B" + name + ")/(A" + name + "-3)");
+        cells.emplace_back(Position{row, 3}, row % 3 ? "text" : "=C" + name + "+" + std::to_string(row));
+    }
+    Sheet serial, parallel;
+    serial.SetThreadCount(1);
+    parallel.SetThreadCount(4);
+    serial.SetCells(cells);
+    parallel.SetCells(cells);
+    for (const auto &[pos, text] : cells)
+    {
+        ASSERT_EQUAL(parallel.GetCell(pos)->GetText(), serial.GetCell(pos)->GetText());
+        ASSERT_EQUAL(parallel.GetCell(pos)->GetValue(), serial.GetCell(pos)->GetValue());
+    }
+    ASSERT_EQUAL(parallel.GetSharedFormulaCount(), serial.GetSharedFormulaCount());
+
+    // every incorrect formula is reported with its position, the sheet is not changed
+    std::vector<std::pair<Position, std::string>> update;
+    for (int row = 0; row < 2000; ++row)
+        update.emplace_back(Position{row, 4}, row % 700 == 1 ? "=A1+" : "=D" + std::to_string(row + 1) + "*2");
+    update.emplace_back("F1"_pos, "=)");
+    update.emplace_back("F2"_pos, "=A1:B2");
+    std::vector<Position> errors;
+    try
+    {
+        parallel.SetCells(update);
+    }
+    catch (const FormulaException &e)
+    {
+        for (const auto &[pos, message] : e.GetErrors())
+        {
+            ASSERT(!message.empty());
+            errors.push_back(pos);
+        }
+    }
+    ASSERT_EQUAL(errors, (std::vector<Position>{"F1"_pos, "E2"_pos, "F2"_pos, "E702"_pos, "E1402"_pos}));
+    ASSERT(parallel.GetCell("E1"_pos) == nullptr);
+    ASSERT_EQUAL(parallel.GetPrintableSize(), (Size{2000, 4}));
+}
+
+void TestParallelRecalculation()
+{
+    // wide levels of formulas over the level above, with ranges, errors and a deep chain on the side
+    auto fill = [](Sheet &sheet) {
+        std::vector<std::pair<Position, std::string>> cells{{"A1"_pos, "1"}};
+        for (int col = 1; col < 300; ++col)
+            cells.emplace_back(Position{0, col}, "=A1+" + std::to_string(col));
+        for (int row = 1; row < 40; ++row)
+        {
+            for (int col = 0; col < 300; ++col)
+            {
+                const Position above{row - 1, col}, left{row - 1, std::max(col - 1, 0)};
+                std::string text = "=" + above.ToString() + "/2+" + left.ToString();
+                if (col % 50 == 7)
+                    text = "=SUM(" + Position{row - 1, col - 5}.ToString() + ":" + above.ToString() + ")/1000";
+                else if (col == 299)
+                    text = "=" + above.ToString() + "/(A1-1)";
+                cells.emplace_back(Position{row, col}, std::move(text));
+            }
+        }
+        for (int row = 0; row < 500; ++row)
+            cells.emplace_back(Position{row, 300},
+                               "=" + Position{std::max(row - 1, 0), row ? 300 : 0}.ToString() + "+1");
+        sheet.SetCells(std::move(cells));
+    };
+    Sheet serial, parallel;
+    serial.SetThreadCount(1);
+    parallel.SetThreadCount(4);
+    fill(serial);
+    fill(parallel);
+    for (const char *input : {"3", "=1/0", "text", "1"})
+    {
+        serial.SetCell("A1"_pos, input);
+        parallel.SetCell("A1"_pos, input);
+        ASSERT_EQUAL(parallel.Recalculate().recomputed_cells, serial.Recalculate().recomputed_cells);
+        for (int row = 0; row < 500; ++row)
+        {
+            for (int col = 0; col <= 300; ++col)
+            {
+                const CellInterface *cell = serial.GetCell({row, col});
+                if (!cell)
+                    continue;
+                ASSERT_EQUAL(parallel.GetCell({row, col})->GetValue(), cell->GetValue());
+            }
+        }
+    }
+    ASSERT_EQUAL(parallel.GetCell("KO500"_pos)->GetValue(), CellInterface::Value(501.0));
+}
+
+void TestConcurrentReaders()
+{
+    // B1:B100 multiply A1, C1 sums them, every formula is left for readers to evaluate
+    Sheet sheet;
+    std::vector<std::pair<Position, std::string>> cells{{"A1"_pos, "1"}, {"C1"_pos, "=SUM(B1:B100)"}};
+    for (int row = 0; row < 100; ++row)
+        cells.emplace_back(Position{row, 1}, "=A1*" + std::to_string(row + 1));
+    sheet.SetCells(std::move(cells));
+
+    // readers see the sheet as const
+    const Sheet &view = sheet;
+    std::atomic<int> mismatches{0};
+    auto read = [&view, &mismatches](int rounds) {
+        for (int round = 0; round < rounds; ++round)
+        {
+            const Sheet::ReadLock lock = view.LockForReading();
+            const double input = std::stod(view.GetCell("A1"_pos)->GetText());
+            for (int row = 99; row >= 0; --row)
+            {
+                if (!(view.GetCell({row, 1})->GetValue() == CellInterface::Value(input * (row + 1))))
+                    ++mismatches;
+            }
+            if (!(view.GetCell("C1"_pos)->GetValue() == CellInterface::Value(input * 5050)))
+                ++mismatches;
+            std::ostringstream output;
+            view.PrintValues(output);
+            if (output.str().find("\t" + std::to_string(static_cast<int>(input * 5050)) + "\n") == std::string::npos)
+                ++mismatches;
+        }
+    };
+
+    // readers race to fill the same caches
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; ++i)
+        readers.emplace_back(read, 20);
+    for (auto &reader : readers)
+        reader.join();
+    ASSERT_EQUAL(mismatches.load(), 0);
+
+    // and keep reading while a writer changes the input
+    auto write = [&sheet](int first, int last) {
+        for (int input = first; input <= last; ++input)
+        {
+            if (input % 2 == 0)
+                sheet.SetCell("A1"_pos, std::to_string(input));
+            else
+                sheet.SetCells({{"A1"_pos, std::to_string(input)}});
+            if (input % 10 == 0)
+                sheet.Recalculate();
+        }
+    };
+    readers.clear();
+    for (int i = 0; i < 4; ++i)
+        readers.emplace_back(read, 50);
+    write(2, 30);
+    for (auto &reader : readers)
+        reader.join();
+    ASSERT_EQUAL(mismatches.load(), 0);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(30.0 * 5050));
+
+    // the same while a snapshot shares the cells with the sheet
+    const auto snapshot = sheet.Snapshot();
+    readers.clear();
+    for (int i = 0; i < 4; ++i)
+        readers.emplace_back(read, 20);
+    for (auto &reader : readers)
+        reader.join();
+    readers.clear();
+    for (int i = 0; i < 4; ++i)
+        readers.emplace_back(read, 50);
+    write(31, 50);
+    for (auto &reader : readers)
+        reader.join();
+    ASSERT_EQUAL(mismatches.load(), 0);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(50.0 * 5050));
+    ASSERT_EQUAL(snapshot->GetCell("C1"_pos)->GetValue(), CellInterface::Value(30.0 * 5050));
+}
+
+void TestSnapshot()
+{
+    // a dense tile of inputs and formulas over them, a sparse one far away
+    auto sheet = std::make_unique<Sheet>();
+    std::vector<std::pair<Position, std::string>> cells{{"A1"_pos, "1"}, {"ZZ1000"_pos, "=A1+1"}};
+    for (int row = 1; row < 40; ++row)
+    {
+        cells.emplace_back(Position{row, 0}, std::to_string(row + 1));
+        cells.emplace_back(Position{row, 1}, "=A" + std::to_string(row + 1) + "*A1");
+    }
+    cells.emplace_back("C1"_pos, "=SUM(B2:B40)");
+    sheet->SetCells(std::move(cells));
+    const uint64_t version = sheet->GetVersion();
+    ASSERT(version > 0);
+
+    auto print = [](const auto &source) {
+        std::ostringstream values, texts;
+        source.PrintValues(values);
+        source.PrintTexts(texts);
+        return values.str() + texts.str();
+    };
+    const std::string printed = print(*sheet);
+    const auto snapshot = sheet->Snapshot();
+    ASSERT_EQUAL(snapshot->GetVersion(), version);
+    ASSERT_EQUAL(sheet->GetVersion(), version);
+    ASSERT_EQUAL(snapshot->GetPrintableSize(), sheet->GetPrintableSize());
+    for (Position pos : {"B2"_pos, "B40"_pos, "C1"_pos, "ZZ1000"_pos})
+        ASSERT(static_cast<const Cell *>(snapshot->GetCell(pos))->IsCached());
+
+    // the sheet goes on while readers look at the snapshot
+    std::atomic<int> mismatches{0};
+    std::thread reader([&snapshot, &mismatches, &printed, &print] {
+        for (int i = 0; i < 50; ++i)
+        {
+            if (!(snapshot->GetCell("C1"_pos)->GetValue() == CellInterface::Value(819.0)) ||
+                print(*snapshot) != printed)
+            {
+                ++mismatches;
+            }
+        }
+    });
+    for (int input = 2; input <= 20; ++input)
+    {
+        sheet->SetCell("A1"_pos, std::to_string(input));
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(819.0 * input));
+    }
+    sheet->ClearCell("B40"_pos);
+    sheet->SetCells({{"A20"_pos, "text"}, {"ZZ1000"_pos, "=1/0"}, {"D50"_pos, "new"}});
+    reader.join();
+    ASSERT_EQUAL(mismatches.load(), 0);
+    ASSERT_EQUAL(sheet->GetVersion(), version + 21);
+
+    const auto later = sheet->Snapshot();
+    ASSERT_EQUAL(later->GetVersion(), version + 21);
+    ASSERT_EQUAL(later->GetPrintableSize(), (Size{1000, 702}));
+    ASSERT(later->GetCell("B40"_pos) == nullptr);
+    ASSERT(std::holds_alternative<FormulaError>(later->GetCell("B20"_pos)->GetValue()));
+    ASSERT_EQUAL(later->GetCell("ZZ1000"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError(FormulaError::Category::Div0)));
+    ASSERT_EQUAL(print(*snapshot), printed);
+    ASSERT_EQUAL(snapshot->GetCell("ZZ1000"_pos)->GetText(), "=A1+1");
+    ASSERT(snapshot->GetCell("D50"_pos) == nullptr);
+
+    // snapshots outlive the sheet
+    sheet.reset();
+    ASSERT_EQUAL(print(*snapshot), printed);
+    ASSERT(std::holds_alternative<FormulaError>(later->GetCell("C1"_pos)->GetValue()));
+    ASSERT_EQUAL(later->GetCell("B19"_pos)->GetValue(), CellInterface::Value(19.0 * 20));
+}
+
+void TestReadersWithSnapshot()
+{
+    // lookups copy nothing, even while a snapshot shares the cells, and readers may take cells of the non-const sheet
+    Sheet sheet;
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < 100; ++row)
+    {
+        cells.emplace_back(Position{row, 0}, std::to_string(row));
+        cells.emplace_back(Position{row, 1}, "=A" + std::to_string(row + 1) + "*2");
+    }
+    sheet.SetCells(std::move(cells));
+    const auto snapshot = sheet.Snapshot();
+
+    std::atomic<int> mismatches{0};
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; ++i)
+    {
+        readers.emplace_back([&sheet, &mismatches] {
+            const Sheet::ReadLock lock = sheet.LockForReading();
+            for (int row = 0; row < 100; ++row)
+            {
+                if (!(sheet.GetCell(Position{row, 1})->GetValue() == CellInterface::Value(row * 2.0)))
+                    ++mismatches;
+            }
+        });
+    }
+    for (auto &reader : readers)
+        reader.join();
+    ASSERT_EQUAL(mismatches.load(), 0);
+    for (Position pos : {"A1"_pos, "B100"_pos})
+        ASSERT(std::as_const(sheet).GetCell(pos) == snapshot->GetCell(pos));
+
+    // a change copies the tile away from the snapshot
+    sheet.SetCell("A1"_pos, "5");
+    ASSERT(std::as_const(sheet).GetCell("B1"_pos) != snapshot->GetCell("B1"_pos));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(10.0));
+    ASSERT_EQUAL(snapshot->GetCell("B1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+    // so does a change through a cell taken before the snapshot
+    CellInterface *cell = sheet.GetCell("A2"_pos);
+    const auto later = sheet.Snapshot();
+    cell->Set("7");
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(14.0));
+    ASSERT_EQUAL(later->GetCell("A2"_pos)->GetText(), "1");
+    ASSERT_EQUAL(later->GetCell("B2"_pos)->GetValue(), CellInterface::Value(2.0));
+}
+
+void TestCompactCells()
+{
+    if constexpr (sizeof(void *) == 8)
+    {
+        ASSERT_EQUAL(sizeof(Cell), 32u);
+    }
+
+    // inline and shared contents read the same way
+    const std::vector<std::pair<std::string, CellInterface::Value>> texts{
+        {"1234567", "1234567"},
+        {"12345678", "12345678"},
+        {"abc", "abc"},
+        {"fifteen chars!!", "fifteen chars!!"},
+        {"sixteen chars!!!", "sixteen chars!!!"},
+        {"'5", "5"},
+        {"'", ""},
+    };
+    for (const auto &[text, value] : texts)
+    {
+        Cell cell;
+        cell.Set(text);
+        ASSERT_EQUAL(cell.GetText(), text);
+        ASSERT_EQUAL(cell.GetValue(), value);
+        ASSERT(!cell.IsEmpty());
+        Cell copy = cell;
+        ASSERT_EQUAL(copy.GetTextView(), text);
+    }
+    Cell cell;
+    cell.Set("'");
+    ASSERT(!cell.GetNumericValue().has_value());
+    cell.Set("abc");
+    ASSERT(cell.GetNumericValue() == std::optional<NumericValue>(FormulaError(FormulaError::Category::Value)));
+    cell.Set("42");
+    ASSERT(cell.GetNumericValue() == std::optional<NumericValue>(42.0));
+    cell.Set("");
+    ASSERT(cell.IsEmpty());
+
+    // formulas read inline and shared numbers alike
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1234567");
+    sheet->SetCell("A2"_pos, "0.000000000000001");
+    sheet->SetCell("A3"_pos, "=A1+A2*1000000000000000+A4");
+    ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetValue(), CellInterface::Value(1234568.0));
+    sheet->SetCell("A4"_pos, "long text, not a number");
+    ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+
+    // a cell outside of a sheet takes formulas too, its references read as empty cells
+    cell.Set("=A1+2");
+    ASSERT_EQUAL(cell.GetText(), "=A1+2");
+    ASSERT_EQUAL(cell.GetValue(), CellInterface::Value(2.0));
+}
+
+void TestSetThroughSheetCell()
+{
+    // a cell of the sheet changes the sheet as SetCell() does
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("C3"_pos, "far");
+    CellInterface *cell = sheet.GetCell("A1"_pos);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+    const auto snapshot = sheet.Snapshot();
+    const uint64_t version = sheet.GetVersion();
+
+    cell->Set("100");
+    ASSERT_EQUAL(cell->GetText(), "100");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(200.0));
+    ASSERT(sheet.GetVersion() != version);
+    ASSERT_EQUAL(snapshot->GetCell("A1"_pos)->GetText(), "1");
+    ASSERT_EQUAL(snapshot->GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{3, 3}));
+    sheet.GetCell("C3"_pos)->Set("");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 2}));
+
+    // formulas are set the same way, a cycle changes nothing
+    cell->Set("=C1+1");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+    try
+    {
+        cell->Set("=B1");
+        ASSERT(false);
+    }
+    catch (const CircularDependencyException &)
+    {
+    }
+    ASSERT_EQUAL(cell->GetText(), "=C1+1");
+
+    // the cell outlives clearing: it reads as empty and sets the position again
+    sheet.ClearCell("A1"_pos);
+    ASSERT(sheet.GetCell("A1"_pos) == nullptr);
+    ASSERT_EQUAL(cell->GetText(), "");
+    cell->Set("3");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos), cell);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(6.0));
+}
+
+void TestReferencedPositionsWithoutCells()
+{
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=SUM(B1:B3)+ZZ5000+C1");
+    sheet.SetCells({{"D1"_pos, "=E1*2"}, {"D2"_pos, "=E2+ZZ5000"}});
+    ASSERT_EQUAL(sheet.GetCellCount(), 3u);
+    for (Position pos : {"B1"_pos, "C1"_pos, "E1"_pos, "E2"_pos, "ZZ5000"_pos})
+        ASSERT(sheet.GetCell(pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{2, 4}));
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+    // a referenced position gets its cell when it is set, dependants see the value
+    sheet.SetCell("ZZ5000"_pos, "5");
+    sheet.SetCell("C1"_pos, "=ZZ5000*2");
+    ASSERT_EQUAL(sheet.GetCellCount(), 5u);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(15.0));
+    ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), CellInterface::Value(5.0));
+    sheet.ClearCell("ZZ5000"_pos);
+    ASSERT(sheet.GetCell("ZZ5000"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+    // cycles through positions without cells are found, failed changes leave no cells
+    try
+    {
+        sheet.SetCell("E1"_pos, "=D1");
+        ASSERT(false);
+    }
+    catch (const CircularDependencyException &)
+    {
+    }
+    try
+    {
+        sheet.SetCell("E2"_pos, "=1+");
+        ASSERT(false);
+    }
+    catch (const FormulaException &)
+    {
+    }
+    ASSERT(sheet.GetCell("E1"_pos) == nullptr);
+    ASSERT(sheet.GetCell("E2"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCellCount(), 4u);
+
+    std::ostringstream texts;
+    sheet.PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), "=SUM(B1:B3)+ZZ5000+C1\t\t=ZZ5000*2\t=E1*2\n\t\t\t=E2+ZZ5000\n");
+}
+
+void TestFlatFormulaTree()
+{
+    using ASTImpl::NodeType;
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "2");
+    sheet->SetCell("C2"_pos, "4");
+
+    const auto ast = ParseFormulaAST("-(A1+B2)*SUM(C1:C3,2,A1)/+3");
+    const ASTImpl::Tree &tree = ast.GetTree();
+    std::vector<NodeType> types;
+    for (const auto &node : tree.nodes)
+        types.push_back(node.type);
+    ASSERT(types == (std::vector{NodeType::Cell, NodeType::Cell, NodeType::Add, NodeType::UnaryMinus, NodeType::Range,
+                                 NodeType::Number, NodeType::Cell, NodeType::Call, NodeType::Multiply,
+                                 NodeType::Number, NodeType::UnaryPlus, NodeType::Divide}));
+    ASSERT_EQUAL(tree.numbers, (std::vector{2.0, 3.0}));
+    ASSERT_EQUAL(tree.arguments, (std::vector<uint32_t>{4, 5, 6}));
+    ASSERT_EQUAL(tree.GetRoot(), 11u);
+    for (uint32_t i = 0; i < tree.nodes.size(); ++i)
+    {
+        const auto &node = tree.nodes[i];
+        if (node.type >= NodeType::UnaryPlus && node.type <= NodeType::Divide)
+            ASSERT(node.first < i && node.second < i);
+    }
+
+    std::ostringstream out;
+    ast.Print(out);
+    out << " | ";
+    ast.PrintFormula(out);
+    ASSERT_EQUAL(out.str(), "(/ (* (- (+ A1 B2)) (SUM C1:C3 2 A1)) (+ 3)) | -(A1+B2)*SUM(C1:C3,2,A1)/+3");
+    ASSERT_EQUAL(ast.Execute(*sheet), EvaluationResult(-2.0 * 8 / 3));
+    ASSERT_EQUAL(ast.ExecuteTree(*sheet), ast.Execute(*sheet));
+}
+
+void TestConstantFolding()
+{
+    using ASTImpl::OpCode;
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "24");
+    sheet->SetCell("A2"_pos, "text");
+
+    auto code = [](const FormulaAST &ast) {
+        std::vector<OpCode> result;
+        for (const auto &instruction : ast.GetBytecode().code)
+            result.push_back(instruction.code);
+        return result;
+    };
+    const std::vector<std::tuple<std::string, std::vector<OpCode>, std::vector<double>>> cases{
+        {"A1*(1+0.05)/12",
+         {OpCode::PushCell, OpCode::PushNumber, OpCode::Multiply, OpCode::PushNumber, OpCode::Divide},
+         {1.05, 12}},
+        {"+(-(-3))", {OpCode::PushNumber}, {3}},
+        {"-(-A1)", {OpCode::PushCell}, {}},
+        {"---A1", {OpCode::PushCell, OpCode::Negate}, {}},
+        {"SUM(1,2,3)*A1", {OpCode::PushNumber, OpCode::PushCell, OpCode::Multiply}, {6}},
+        {"MAX(A1:A2,1+1)", {OpCode::PushNumber, OpCode::Call}, {2}},
+        // errors are left to the evaluation
+        {"1/0", {OpCode::PushNumber, OpCode::PushNumber, OpCode::Divide}, {1, 0}},
+        {"A2+1/0", {OpCode::PushCell, OpCode::PushNumber, OpCode::PushNumber, OpCode::Divide, OpCode::Add}, {1, 0}},
+        {"1e308*10", {OpCode::PushNumber, OpCode::PushNumber, OpCode::Multiply}, {1e308, 10}},
+    };
+    for (const auto &[expression, expected_code, expected_constants] : cases)
+    {
+        const auto ast = ParseFormulaAST(expression);
+        ASSERT(code(ast) == expected_code);
+        ASSERT_EQUAL(ast.GetBytecode().constants, expected_constants);
+        ASSERT_EQUAL(ast.Execute(*sheet), ast.ExecuteTree(*sheet));
+    }
+
+    // the text keeps every node
+    sheet->SetCell("B1"_pos, "=A1*(1+0.05)/12");
+    sheet->SetCell("B2"_pos, "=+(-(-3))");
+    sheet->SetCell("B3"_pos, "=A2+1/0");
+    sheet->SetCell("B4"_pos, "=-1/(2-2)");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetText(), "=A1*(1+0.05)/12");
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetText(), "=+--3");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(24 * 1.05 / 12));
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(), CellInterface::Value(3.0));
+    ASSERT_EQUAL(sheet->GetCell("B3"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+    ASSERT_EQUAL(sheet->GetCell("B4"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError(FormulaError::Category::Div0)));
+}
+
+void TestBoundReferences()
+{
+    // the layout version changes when values may be moved or erased, or when one is inserted
+    TiledTable<int> table;
+    const uint64_t initial = table.GetLayoutVersion();
+    table.Emplace({0, 0}) = 1;
+    const uint64_t inserted = table.GetLayoutVersion();
+    ASSERT(inserted != initial);
+    table.Emplace({0, 0}) = 2;
+    ASSERT(table.Find({1, 1}) == nullptr);
+    ASSERT_EQUAL(table.GetLayoutVersion(), inserted);
+    const TiledTable<int> shared = table.Share();
+    table.Emplace({0, 0}) = 3; // copies the shared tile
+    const uint64_t copied = table.GetLayoutVersion();
+    ASSERT(copied != inserted);
+    ASSERT_EQUAL(*shared.Find({0, 0}), 2);
+    ASSERT(table.Erase({0, 0}));
+    ASSERT(table.GetLayoutVersion() != copied);
+
+    // formulas read the cells bound to their references, and find them again after the layout changes
+    Sheet sheet;
+    auto value = [&sheet](Position pos) { return sheet.GetCell(pos)->GetValue(); };
+    sheet.SetCell("A1"_pos, "=B1+C1*2");
+    ASSERT_EQUAL(value("A1"_pos), CellInterface::Value(0.0));
+    sheet.SetCell("B1"_pos, "1");
+    sheet.SetCell("C1"_pos, "=B1+1");
+    ASSERT_EQUAL(value("A1"_pos), CellInterface::Value(5.0));
+    sheet.SetCell("B1"_pos, "2");
+    ASSERT_EQUAL(value("A1"_pos), CellInterface::Value(8.0));
+
+    // filling the tile moves its cells from the sparse map to the dense array
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 1; row < 20; ++row)
+    {
+        for (int col = 0; col < 40; ++col)
+            cells.emplace_back(Position{row, col}, "1");
+    }
+    sheet.SetCells(std::move(cells));
+    sheet.SetCell("B1"_pos, "3");
+    ASSERT_EQUAL(value("A1"_pos), CellInterface::Value(11.0));
+    sheet.ClearCell("B1"_pos);
+    ASSERT_EQUAL(value("A1"_pos), CellInterface::Value(2.0));
+
+    // cells copied away from a snapshot are bound again, the snapshot keeps its values
+    const auto snapshot = sheet.Snapshot();
+    sheet.SetRecalculationMode(RecalculationMode::Automatic);
+    sheet.SetThreadCount(4);
+    sheet.SetCell("B1"_pos, "4");
+    ASSERT_EQUAL(value("A1"_pos), CellInterface::Value(14.0));
+    ASSERT_EQUAL(snapshot->GetCell("A1"_pos)->GetValue(), CellInterface::Value(2.0));
+    sheet.SetCell("B1"_pos, "5");
+    ASSERT_EQUAL(value("A1"_pos), CellInterface::Value(17.0));
+}
+
+void TestTiledTable()
+{
+    TiledTable<int> table;
+    const std::vector<Position> positions{{0, 0}, {0, 64}, {1, 3}, {63, 63}, {64, 0}, {16383, 16383}};
+    for (size_t i = 0; i < positions.size(); ++i)
+    {
+        table.Emplace(positions[i]) = static_cast<int>(i);
+    }
+    ASSERT_EQUAL(table.Count(), positions.size());
+    ASSERT_EQUAL(table.TileCount(), 4u);
+    ASSERT_EQUAL(*table.Find({63, 63}), 3);
+    ASSERT(table.Find({63, 64}) == nullptr);
+
+    std::vector<Position> visited;
+    table.ForEach([&](Position pos, int) { visited.push_back(pos); });
+    std::sort(visited.begin(), visited.end());
+    ASSERT_EQUAL(visited, positions);
+
+    ASSERT(table.Erase({64, 0}));
+    ASSERT(!table.Erase({64, 0}));
+    ASSERT_EQUAL(table.TileCount(), 3u);
+    ASSERT_EQUAL(table.Emplace({0, 64}), 1);
+
+    // filling a tile switches it from the sparse map to the dense array
+    ASSERT_EQUAL(table.DenseTileCount(), 0u);
+    for (int row = 128; row < 192; ++row)
+    {
+        for (int col = 0; col < 64; ++col)
+        {
+            table.Emplace({row, col}) = row * col;
+        }
+    }
+    ASSERT_EQUAL(table.DenseTileCount(), 1u);
+    ASSERT_EQUAL(*table.Find({191, 63}), 191 * 63);
+    ASSERT_EQUAL(table.Count(), positions.size() - 1 + 64 * 64);
+}
+
+void TestStableCells()
+{
+    // values keep their addresses while other values of the tile are inserted and erased
+    TiledTable<int> table;
+    int *first = &table.Emplace({0, 0});
+    *first = 7;
+    for (int col = 1; col < 64; ++col)
+    {
+        table.Emplace({0, col}) = col;
+    }
+    ASSERT(table.Erase({0, 1}));
+    ASSERT_EQUAL(table.Find({0, 0}), first);
+    ASSERT_EQUAL(*first, 7);
+
+    // the same holds for cells of a sheet, across rehashing of the sparse map and the switch to the dense index
+    Sheet sheet;
+    const Sheet &view = sheet;
+    sheet.SetCell("A1"_pos, "short text");
+    sheet.SetCell("B1"_pos, "=A2*2");
+    const CellInterface *text = view.GetCell("A1"_pos);
+    const CellInterface *formula = view.GetCell("B1"_pos);
+    const auto text_view = std::get<std::string_view>(text->GetValueView());
+    for (int row = 1; row < 64; ++row)
+    {
+        for (int col = 0; col < 64; ++col)
+            sheet.SetCell({row, col}, std::to_string(row + col));
+        sheet.ClearCell({row - 1, 63});
+    }
+    ASSERT_EQUAL(view.GetCell("A1"_pos), text);
+    ASSERT_EQUAL(view.GetCell("B1"_pos), formula);
+    ASSERT_EQUAL(text_view, "short text");
+    ASSERT_EQUAL(formula->GetValue(), CellInterface::Value(2.0));
+
+    // a tile copied away from a snapshot leaves the earlier cells and views to the snapshot
+    const auto snapshot = sheet.Snapshot();
+    sheet.SetCell("C1"_pos, "changed");
+    ASSERT(view.GetCell("A1"_pos) != text);
+    ASSERT_EQUAL(snapshot->GetCell("A1"_pos), text);
+    ASSERT_EQUAL(text_view, "short text");
+}
+
+void TestFlatPositionMap()
+{
+    FlatPositionMap<int> map;
+    for (int i = 0; i < 1000; ++i)
+    {
+        map.Emplace({i, i % 37}) = i;
+    }
+    ASSERT_EQUAL(map.Size(), 1000u);
+    for (int i = 0; i < 1000; i += 2)
+    {
+        ASSERT(map.Erase({i, i % 37}));
+    }
+    ASSERT_EQUAL(map.Size(), 500u);
+    for (int i = 0; i < 1000; ++i)
+    {
+        const int *value = map.Find({i, i % 37});
+        ASSERT_EQUAL(value != nullptr, i % 2 == 1);
+        if (value)
+        {
+            ASSERT_EQUAL(*value, i);
+        }
+    }
+
+    auto stats = map.GetStats();
+    ASSERT_EQUAL(stats.size, 500u);
+    ASSERT(stats.LoadFactor() <= 0.75);
+
+    const std::vector<Position> cells{"A1"_pos, "B2"_pos, "A1"_pos, "XFD16384"_pos};
+    FlatPositionSet set{cells.begin(), cells.end()};
+    ASSERT_EQUAL(set.Size(), 3u);
+    std::set<Position> iterated{set.begin(), set.end()};
+    ASSERT_EQUAL(iterated, (std::set<Position>{"A1"_pos, "B2"_pos, "XFD16384"_pos}));
+}
 } // namespace
 
 int main()
@@ -389,14 +1570,41 @@ int main()
     RUN_TEST(tr, TestFormulaReferences);
     RUN_TEST(tr, TestFormulaExpressionFormatting);
     RUN_TEST(tr, TestFormulaReferencedCells);
+    RUN_TEST(tr, TestFormulaReferencesSorted);
+    RUN_TEST(tr, TestFormulaCanonicalText);
     RUN_TEST(tr, TestErrorValue);
     RUN_TEST(tr, TestErrorDiv0);
     RUN_TEST(tr, TestEmptyCellTreatedAsZero);
     RUN_TEST(tr, TestFormulaInvalidPosition);
     RUN_TEST(tr, TestPrint);
+    RUN_TEST(tr, TestValueView);
+    RUN_TEST(tr, TestPrintableSizeTracking);
     RUN_TEST(tr, TestCellReferences);
     RUN_TEST(tr, TestFormulaIncorrect);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestCircularReferencesAfterReordering);
+    RUN_TEST(tr, TestDeepChainEvaluation);
+    RUN_TEST(tr, TestRangeFunctions);
+    RUN_TEST(tr, TestNumericTextValues);
+    RUN_TEST(tr, TestSharedFormulas);
+    RUN_TEST(tr, TestBytecodeMatchesTreeWalker);
+    RUN_TEST(tr, TestHandWrittenParserMatchesAntlr);
+    RUN_TEST(tr, TestRecalculation);
+    RUN_TEST(tr, TestSetCells);
+    RUN_TEST(tr, TestParallelSetCells);
+    RUN_TEST(tr, TestParallelRecalculation);
+    RUN_TEST(tr, TestConcurrentReaders);
+    RUN_TEST(tr, TestSnapshot);
+    RUN_TEST(tr, TestReadersWithSnapshot);
+    RUN_TEST(tr, TestCompactCells);
+    RUN_TEST(tr, TestSetThroughSheetCell);
+    RUN_TEST(tr, TestReferencedPositionsWithoutCells);
+    RUN_TEST(tr, TestFlatFormulaTree);
+    RUN_TEST(tr, TestConstantFolding);
+    RUN_TEST(tr, TestBoundReferences);
+    RUN_TEST(tr, TestTiledTable);
+    RUN_TEST(tr, TestStableCells);
+    RUN_TEST(tr, TestFlatPositionMap);
 
     return 0;
 }
\ No newline at end of file